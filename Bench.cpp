@@ -0,0 +1,514 @@
+/*
+ * Bench.cpp
+ *
+ * Benchmarks for Taily that don't need real shard dbs:
+ *   TailyBench gen -p PARAM_FILE   writes a synthetic corpus db and shard dbs
+ *   TailyBench rank -p PARAM_FILE  reports rank() latency and throughput by shard count and query length
+ *   TailyBench store -p PARAM_FILE reports FeatureStore get/put/iterate rates by dataset and cache size
+ *
+ *  Created on: Mar 27, 2014
+ *      Author: yubink
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <math.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <iostream>
+#include <fstream>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <map>
+
+#include "FeatureStore.h"
+#include "Params.h"
+#include "ShardRanker.h"
+#include "TermNormalizer.h"
+
+using namespace std;
+
+// numeric parameter, or def if it isn't given
+double numParam(map<string, string>& params, const string& key, double def) {
+  if (params.find(key) == params.end()) {
+    return def;
+  }
+  return atof(params[key].c_str());
+}
+
+double getTime() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+// deterministic uniform [0, 1) from a seed and two ids, so a term's shards don't depend on the
+// order things are generated in (splitmix64 finalizer)
+double uniform(uint64_t seed, uint64_t a, uint64_t b) {
+  uint64_t x = seed * 0x9E3779B97F4A7C15ULL + a * 0xBF58476D1CE4E5B9ULL + b * 0x94D049BB133111EBULL;
+  x ^= x >> 30;
+  x *= 0xBF58476D1CE4E5B9ULL;
+  x ^= x >> 27;
+  x *= 0x94D049BB133111EBULL;
+  x ^= x >> 31;
+  return (x >> 11) * (1.0 / 9007199254740992.0);
+}
+
+string termName(uint t) {
+  char name[32];
+  snprintf(name, sizeof(name), "t%u", t);
+  return name;
+}
+
+// synthetic stats: term t (0 being the most common) is in about maxDf / (t+1)^zipf docs, where
+// maxDf is a fifth of the corpus. It is in a fraction of the shards that grows with its df
+// from minCoverage (df 1) to maxCoverage (df maxDf), and its docs are spread over those shards
+// in proportion to their size. Its features are normal around a per-term mean in the range of
+// Indri's log query likelihood scores.
+void generate(map<string, string>& params) {
+  string dir = params["dir"];
+  uint numShards = (uint) numParam(params, "shards", 100);
+  uint vocab = (uint) numParam(params, "vocab", 100000);
+  double zipf = numParam(params, "zipf", 1.0);
+  double docs = numParam(params, "docs", 50000);
+  double minCoverage = numParam(params, "minCoverage", 0.01);
+  double maxCoverage = numParam(params, "maxCoverage", 1.0);
+  uint64_t seed = (uint64_t) numParam(params, "seed", 1);
+  int ram = (int) numParam(params, "ram", 1000);
+
+  if (dir.empty() || mkdir(dir.c_str(), 0777) == -1) {
+    cerr << "Error creating output dir. Dir '" << dir << "' may already exist." << endl;
+    exit(EXIT_FAILURE);
+  }
+
+  vector<string> dbs;
+  dbs.push_back(dir + "/corpus");
+  for (uint i = 1; i <= numShards; i++) {
+    char name[32];
+    snprintf(name, sizeof(name), "/shard%u", i);
+    dbs.push_back(dir + name);
+  }
+  for (uint i = 0; i < dbs.size(); i++) {
+    if (mkdir(dbs[i].c_str(), 0777) == -1) {
+      cerr << "Error creating output DB dir " << dbs[i] << endl;
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  // shard sizes vary by +-50% around docs
+  vector<double> sizes(numShards + 1, 0.0);
+  for (uint i = 1; i <= numShards; i++) {
+    sizes[i] = floor(docs * (0.5 + uniform(seed, 0, i)));
+    sizes[0] += sizes[i];
+  }
+  double maxDf = max(sizes[0] / 5, 1.0);
+
+  // corpus-wide sums, filled in shard by shard so only one shard store is open at a time
+  vector<double> corpusDf(vocab, 0.0);
+  vector<double> corpusCtf(vocab, 0.0);
+  vector<double> corpusMin(vocab, DBL_MAX);
+
+  for (uint i = 1; i <= numShards; i++) {
+    FeatureStore store(dbs[i], false, ram / 2);
+    store.startBulkLoad(ram / 2);
+
+    string sizeKey(FeatureStore::SIZE_FEAT_SUFFIX);
+    store.putFeature((char*) sizeKey.c_str(), sizes[i], (int) sizes[i]);
+
+    for (uint t = 0; t < vocab; t++) {
+      double df = max(maxDf / pow(t + 1.0, zipf), 1.0);
+      double coverage = minCoverage + (maxCoverage - minCoverage) * log(df) / log(max(maxDf, 2.0));
+      if (uniform(seed, t, i) >= coverage) {
+        continue;
+      }
+
+      FeatureStore::TermStats stats;
+      stats.df = floor(df / coverage * sizes[i] / sizes[0] * (0.5 + uniform(seed + 1, t, i)));
+      stats.df = min(max(stats.df, 1.0), sizes[i]);
+
+      double mean = -11.0 + 4.0 * uniform(seed + 2, t, 0) + 0.5 * (uniform(seed + 3, t, i) - 0.5);
+      double sd = (stats.df > 1) ? 0.3 + 0.7 * uniform(seed + 4, t, 0) : 0.0;
+      stats.f = stats.df * mean;
+      stats.f2 = stats.df * (mean * mean + sd * sd);
+      stats.min = mean - 3.0 * sd;
+
+      double ctf = floor(stats.df * (1.0 + 2.0 * uniform(seed + 5, t, i)));
+      string stem = termName(t);
+      store.putTermStats(stem.c_str(), stats, (int) ctf);
+
+      corpusDf[t] += stats.df;
+      corpusCtf[t] += ctf;
+      corpusMin[t] = min(corpusMin[t], stats.min);
+    }
+    cout << "Wrote " << dbs[i] << endl;
+  }
+
+  FeatureStore corpus(dbs[0], false, ram / 2);
+  corpus.startBulkLoad(ram / 2);
+
+  double totalTermCount = 0;
+  for (uint t = 0; t < vocab; t++) {
+    if (corpusDf[t] == 0) {
+      continue;
+    }
+    string stem = termName(t);
+    int frequency = (int) corpusCtf[t];
+    corpus.putFeature((char*) (stem + FeatureStore::SIZE_FEAT_SUFFIX).c_str(), corpusDf[t], frequency);
+    corpus.putFeature((char*) (stem + FeatureStore::TERM_SIZE_FEAT_SUFFIX).c_str(), corpusCtf[t], frequency);
+    corpus.putFeature((char*) (stem + FeatureStore::MIN_FEAT_SUFFIX).c_str(), corpusMin[t], frequency);
+    totalTermCount += corpusCtf[t];
+  }
+
+  string totalTermKey(FeatureStore::TERM_SIZE_FEAT_SUFFIX);
+  corpus.putFeature((char*) totalTermKey.c_str(), totalTermCount, FeatureStore::FREQUENT_TERMS+1);
+  string sizeKey(FeatureStore::SIZE_FEAT_SUFFIX);
+  corpus.putFeature((char*) sizeKey.c_str(), sizes[0], FeatureStore::FREQUENT_TERMS+1);
+
+  // terms are already stems; the ranker takes them as they are
+  string normalizerPath = dbs[0] + "/" + TermNormalizer::FILE_NAME;
+  ofstream normalizer(normalizerPath.c_str());
+  normalizer << "normalize=false" << endl;
+  normalizer.close();
+
+  // parameter file for Taily run and TailyBench rank over the generated dbs
+  string dbList;
+  for (uint i = 0; i < dbs.size(); i++) {
+    if (i > 0) {
+      dbList.push_back(':');
+    }
+    dbList.append(dbs[i]);
+  }
+  string runPath = dir + "/run.param";
+  ofstream run(runPath.c_str());
+  run << "db=" << dbList << endl;
+  run << "n_c=400" << endl;
+  run.close();
+  cout << "Wrote " << dbs[0] << " and " << runPath << endl;
+}
+
+// query terms are drawn from the corpus db's stems with probability proportional to the square
+// root of their frequency, which favors common terms without letting the most common ones make
+// up every query
+class QuerySampler {
+private:
+  vector<string> _stems;
+  vector<double> _cumulative;
+
+public:
+  QuerySampler(const string& corpusDb) {
+    FeatureStore corpus(corpusDb, true);
+    FeatureStore::TermIterator* termit = corpus.getTermIterator();
+    double total = 0;
+    for (; !termit->finished(); termit->nextTerm()) {
+      pair<string, double> entry = termit->currrentEntry();
+      total += sqrt(max(entry.second, 0.0));
+      _stems.push_back(entry.first);
+      _cumulative.push_back(total);
+    }
+    delete termit;
+
+    if (_stems.empty()) {
+      cerr << "Corpus db " << corpusDb << " has no terms. Exiting." << endl;
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  string query(uint length) {
+    string query;
+    for (uint j = 0; j < length; j++) {
+      double r = drand48() * _cumulative.back();
+      size_t t = upper_bound(_cumulative.begin(), _cumulative.end(), r) - _cumulative.begin();
+      if (j > 0) {
+        query.push_back(' ');
+      }
+      query.append(_stems[min(t, _stems.size() - 1)]);
+    }
+    return query;
+  }
+};
+
+// work of one timing thread: ranks queries[q] for q = first, first+step, ...
+struct RankJob {
+  ShardRanker* ranker;
+  const vector<string>* queries;
+  size_t first;
+  size_t step;
+  vector<double>* latencies; // seconds, by query
+};
+
+void* rankJob(void* arg) {
+  RankJob* job = (RankJob*) arg;
+  vector<ShardScore> ranking;
+  for (size_t q = job->first; q < job->queries->size(); q += job->step) {
+    double start = getTime();
+    job->ranker->rank((*job->queries)[q], &ranking);
+    (*job->latencies)[q] = getTime() - start;
+  }
+  return NULL;
+}
+
+// value at quantile p of sorted values; 0 if there are none
+double percentile(const vector<double>& sorted, double p) {
+  if (sorted.empty()) {
+    return 0.0;
+  }
+  size_t i = (size_t) (p * (sorted.size() - 1) + 0.5);
+  return sorted[min(i, sorted.size() - 1)];
+}
+
+// ranks random queries of each length against the first K shards of the db list for each K, and
+// prints one line per (K, length) with the latency percentiles and the throughput
+void rankBench(map<string, string>& params) {
+  vector<string> dbs;
+  tokenize(params["db"], ":", &dbs);
+  if (dbs.size() < 2) {
+    cerr << "TailyBench rank needs a corpus db and at least one shard db. Exiting." << endl;
+    exit(EXIT_FAILURE);
+  }
+  uint numShards = dbs.size() - 1;
+
+  uint n_c = (uint) numParam(params, "n_c", 400);
+  size_t numQueries = max((size_t) numParam(params, "queries", 1000), (size_t) 1);
+  uint numThreads = max((uint) numParam(params, "threads", 1), (uint) 1);
+  int ram = (int) numParam(params, "ram", ShardRanker::DEFAULT_CACHE);
+  srand48((long) numParam(params, "seed", 1));
+
+  vector<string> values;
+  vector<uint> lengths;
+  tokenize(params.find("queryLengths") != params.end() ? params["queryLengths"] : "1:2:4:8", ":", &values);
+  for (size_t i = 0; i < values.size(); i++) {
+    lengths.push_back(atoi(values[i].c_str()));
+  }
+
+  // shard counts above the # of dbs (or "all") mean all of them
+  values.clear();
+  vector<uint> shardCounts;
+  tokenize(params.find("shardCounts") != params.end() ? params["shardCounts"] : "all", ":", &values);
+  for (size_t i = 0; i < values.size(); i++) {
+    uint count = (values[i] == "all") ? numShards : atoi(values[i].c_str());
+    shardCounts.push_back(min(max(count, (uint) 1), numShards));
+  }
+
+  QuerySampler sampler(dbs[0]);
+
+  printf("shards\tlength\tqueries\tthreads\tp50_us\tp99_us\tmean_us\tqps\n");
+  for (size_t s = 0; s < shardCounts.size(); s++) {
+    // a ranker over a prefix of the shards; the corpus stats still cover all of them
+    vector<string> shardDbs(dbs.begin(), dbs.begin() + shardCounts[s] + 1);
+    ShardRanker ranker(shardDbs, NULL, n_c, ram);
+    ranker.init((int) numParam(params, "preload", 0));
+    ranker.setFastMode(numParam(params, "fastError", 0.0));
+
+    for (size_t l = 0; l < lengths.size(); l++) {
+      vector<string> queries;
+      for (size_t q = 0; q < numQueries; q++) {
+        queries.push_back(sampler.query(lengths[l]));
+      }
+
+      // one untimed pass warms the db cache and the ranker's scratch memory
+      vector<ShardScore> ranking;
+      for (size_t q = 0; q < queries.size(); q++) {
+        ranker.rank(queries[q], &ranking);
+      }
+
+      vector<double> latencies(queries.size(), 0.0);
+      vector<RankJob> jobs(numThreads);
+      vector<pthread_t> threads(numThreads);
+      double start = getTime();
+      for (uint t = 0; t < numThreads; t++) {
+        jobs[t].ranker = &ranker;
+        jobs[t].queries = &queries;
+        jobs[t].first = t;
+        jobs[t].step = numThreads;
+        jobs[t].latencies = &latencies;
+        pthread_create(&threads[t], NULL, rankJob, &jobs[t]);
+      }
+      for (uint t = 0; t < numThreads; t++) {
+        pthread_join(threads[t], NULL);
+      }
+      double elapsed = getTime() - start;
+
+      double sum = 0;
+      for (size_t q = 0; q < latencies.size(); q++) {
+        sum += latencies[q];
+      }
+      sort(latencies.begin(), latencies.end());
+
+      printf("%u\t%u\t%lu\t%u\t%.1f\t%.1f\t%.1f\t%.0f\n", shardCounts[s], lengths[l],
+          (unsigned long) queries.size(), numThreads, percentile(latencies, 0.5) * 1e6,
+          percentile(latencies, 0.99) * 1e6, sum / latencies.size() * 1e6, queries.size() / elapsed);
+      fflush(stdout);
+    }
+  }
+}
+
+// evicts a file from the page cache, so the next reads come from disk
+void dropPageCache(const string& path) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return;
+  }
+  fdatasync(fd);
+  posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+  close(fd);
+}
+
+void printRate(size_t keys, int cache, const char* op, size_t count, double elapsed) {
+  printf("%lu\t%d\t%s\t%lu\t%.0f\n", (unsigned long) keys, cache, op, (unsigned long) count,
+      count / elapsed);
+  fflush(stdout);
+}
+
+// times count lookups of keys[order[i]] with getFeature
+void timeGets(FeatureStore* store, const vector<string>& keys, const vector<size_t>& order,
+    size_t keySize, int cache, const char* op) {
+  double val;
+  double start = getTime();
+  for (size_t i = 0; i < order.size(); i++) {
+    store->getFeature((char*) keys[order[i]].c_str(), &val);
+  }
+  printRate(keySize, cache, op, order.size(), getTime() - start);
+}
+
+// For every dataset size and cache size: fills a new store with that many keys (a tenth of them
+// frequent, so they go to freq.db and the rest to infreq.db) by putFeature and by a bulk load,
+// updates a tenth of them with addValFeature, then reopens it read-only and times random
+// getFeature hits in freq.db, hits in infreq.db (found after a freq.db miss) and misses (both dbs
+// probed), first with the dbs dropped from the page cache (cold) and then again (warm), and a
+// full TermIterator scan. Prints one line per operation with its rate per second.
+void storeBench(map<string, string>& params) {
+  string dir = params["dir"];
+  size_t numGets = (size_t) numParam(params, "gets", 100000);
+  srand48((long) numParam(params, "seed", 1));
+
+  vector<string> values;
+  vector<size_t> keyCounts;
+  tokenize(params.find("keys") != params.end() ? params["keys"] : "100000:1000000", ":", &values);
+  for (size_t i = 0; i < values.size(); i++) {
+    keyCounts.push_back(atol(values[i].c_str()));
+  }
+
+  values.clear();
+  vector<int> caches;
+  tokenize(params.find("caches") != params.end() ? params["caches"] : "16:512", ":", &values);
+  for (size_t i = 0; i < values.size(); i++) {
+    caches.push_back(atoi(values[i].c_str()));
+  }
+
+  if (dir.empty() || mkdir(dir.c_str(), 0777) == -1) {
+    cerr << "Error creating output dir. Dir '" << dir << "' may already exist." << endl;
+    exit(EXIT_FAILURE);
+  }
+
+  printf("keys\tcache_mb\top\tcount\tops_per_sec\n");
+  for (size_t k = 0; k < keyCounts.size(); k++) {
+    size_t numKeys = keyCounts[k];
+
+    // stems as in a corpus db; every tenth one is frequent
+    vector<string> keys;
+    vector<size_t> freqKeys, infreqKeys;
+    for (size_t i = 0; i < numKeys; i++) {
+      keys.push_back(termName(i) + FeatureStore::TERM_SIZE_FEAT_SUFFIX);
+      (i % 10 == 0 ? freqKeys : infreqKeys).push_back(i);
+    }
+    vector<string> missingKeys;
+    for (size_t i = 0; i < numKeys; i++) {
+      missingKeys.push_back(termName(numKeys + i) + FeatureStore::TERM_SIZE_FEAT_SUFFIX);
+    }
+
+    // random lookups of each kind
+    vector<size_t> freqOrder, infreqOrder, missOrder;
+    for (size_t i = 0; i < numGets; i++) {
+      freqOrder.push_back(freqKeys[(size_t) (drand48() * freqKeys.size())]);
+      infreqOrder.push_back(infreqKeys.empty() ? 0 : infreqKeys[(size_t) (drand48() * infreqKeys.size())]);
+      missOrder.push_back((size_t) (drand48() * numKeys));
+    }
+
+    for (size_t c = 0; c < caches.size(); c++) {
+      int cache = caches[c];
+      char name[64];
+      snprintf(name, sizeof(name), "/%lu_%d", (unsigned long) numKeys, cache);
+      string path = dir + name;
+      string bulkPath = path + "_bulk";
+      if (mkdir(path.c_str(), 0777) == -1 || mkdir(bulkPath.c_str(), 0777) == -1) {
+        cerr << "Error creating output DB dir " << path << endl;
+        exit(EXIT_FAILURE);
+      }
+
+      {
+        FeatureStore store(path, false, cache);
+        double start = getTime();
+        for (size_t i = 0; i < numKeys; i++) {
+          int frequency = (i % 10 == 0) ? FeatureStore::FREQUENT_TERMS + 1 : 1;
+          store.putFeature((char*) keys[i].c_str(), (double) i, frequency);
+        }
+        printRate(numKeys, cache, "put", numKeys, getTime() - start);
+
+        start = getTime();
+        size_t numAdds = numKeys / 10;
+        for (size_t i = 0; i < numAdds; i++) {
+          size_t key = (size_t) (drand48() * numKeys);
+          store.addValFeature((char*) keys[key].c_str(), 1.0, 1);
+        }
+        printRate(numKeys, cache, "addval", numAdds, getTime() - start);
+      }
+
+      {
+        // the flush when the store is deleted is part of a bulk load
+        double start = getTime();
+        FeatureStore* store = new FeatureStore(bulkPath, false, cache);
+        store->startBulkLoad(cache);
+        for (size_t i = 0; i < numKeys; i++) {
+          int frequency = (i % 10 == 0) ? FeatureStore::FREQUENT_TERMS + 1 : 1;
+          store->putFeature((char*) keys[i].c_str(), (double) i, frequency);
+        }
+        delete store;
+        printRate(numKeys, cache, "bulkput", numKeys, getTime() - start);
+      }
+
+      dropPageCache(path + "/freq.db");
+      dropPageCache(path + "/infreq.db");
+
+      FeatureStore store(path, true, cache);
+      timeGets(&store, keys, freqOrder, numKeys, cache, "get_freq_cold");
+      timeGets(&store, keys, infreqOrder, numKeys, cache, "get_infreq_cold");
+      timeGets(&store, missingKeys, missOrder, numKeys, cache, "get_miss_cold");
+      timeGets(&store, keys, freqOrder, numKeys, cache, "get_freq_warm");
+      timeGets(&store, keys, infreqOrder, numKeys, cache, "get_infreq_warm");
+      timeGets(&store, missingKeys, missOrder, numKeys, cache, "get_miss_warm");
+
+      double start = getTime();
+      size_t scanned = 0;
+      FeatureStore::TermIterator* termit = store.getTermIterator();
+      for (; !termit->finished(); termit->nextTerm()) {
+        scanned++;
+      }
+      delete termit;
+      printRate(numKeys, cache, "iterate", scanned, getTime() - start);
+    }
+  }
+}
+
+int main(int argc, char * argv[]) {
+  char* paramFile = getOption(argv, argv + argc, "-p");
+
+  std::map<string, string> params;
+  readParams(paramFile, &params);
+
+  if (argc > 1 && strcmp(argv[1], "gen") == 0) {
+    generate(params);
+  } else if (argc > 1 && strcmp(argv[1], "rank") == 0) {
+    rankBench(params);
+  } else if (argc > 1 && strcmp(argv[1], "store") == 0) {
+    storeBench(params);
+  } else {
+    std::cout << "Usage: TailyBench gen|rank|store -p PARAM_FILE" << std::endl;
+    return EXIT_FAILURE;
+  }
+  return 0;
+}
@@ -0,0 +1,378 @@
+/*
+ * CompiledStore.cpp
+ *
+ *  Created on: Mar 11, 2014
+ *      Author: yubink
+ */
+
+#include "CompiledStore.h"
+#include <algorithm>
+#include <iostream>
+#include <fstream>
+#include <string.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+using namespace std;
+
+const char* CompiledStore::FILE_NAME = "stats.bin";
+const char CompiledStore::MAGIC[8] = { 'T', 'A', 'I', 'L', 'Y', 'C', 'S', '\0' };
+
+// bits per key in each level of the hash; more bits mean fewer levels but a bigger directory
+static const double GAMMA = 2.0;
+
+// murmur3 finalizer; spreads every input bit over the whole word
+static inline uint64_t mix64(uint64_t h) {
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return h;
+}
+
+static inline uint64_t levelPosition(uint64_t hash, uint32_t level, uint64_t numBits) {
+  return mix64(hash ^ ((level + 1) * 0x9e3779b97f4a7c15ULL)) % numBits;
+}
+
+static inline uint32_t fingerprint(uint64_t hash) {
+  return (uint32_t) (mix64(hash + 0x165667b19e3779f9ULL) >> 32);
+}
+
+static inline uint64_t align(uint64_t offset, uint64_t alignment) {
+  return (offset + alignment - 1) & ~(alignment - 1);
+}
+
+static void pad(ofstream& out, uint64_t* pos, uint64_t target) {
+  static const char zeros[64] = { 0 };
+  while (*pos < target) {
+    uint64_t n = min((uint64_t) sizeof(zeros), target - *pos);
+    out.write(zeros, n);
+    *pos += n;
+  }
+}
+
+static bool fallbackSort(const CompiledStore::Fallback& i, const CompiledStore::Fallback& j) {
+  return i.hash < j.hash;
+}
+
+uint64_t CompiledStore::hashKey(const char* key, size_t length) {
+  // FNV-1a, finished off with a full avalanche
+  uint64_t h = 0xcbf29ce484222325ULL;
+  for (size_t i = 0; i < length; i++) {
+    h ^= (unsigned char) key[i];
+    h *= 0x100000001b3ULL;
+  }
+  return mix64(h);
+}
+
+void CompiledStore::Writer::add(const char* key, const void* val, u_int32_t size) {
+  _records.push_back(make_pair(string(key), string((const char*) val, size)));
+}
+
+bool CompiledStore::Writer::write(const string& path) {
+  uint64_t numKeys = _records.size();
+
+  vector<uint64_t> hashes(numKeys);
+  for (uint64_t i = 0; i < numKeys; i++) {
+    hashes[i] = hashKey(_records[i].first.c_str(), _records[i].first.size());
+  }
+
+  // build the hash level by level; keys that collide at a level move on to the next one
+  vector<uint64_t> slots(numKeys);
+  vector<uint64_t> remaining(numKeys);
+  for (uint64_t i = 0; i < numKeys; i++) {
+    remaining[i] = i;
+  }
+
+  vector<Level> levels;
+  vector<vector<Block> > levelBlocks;
+  uint64_t slotBase = 0;
+
+  for (uint32_t l = 0; l < MAX_LEVELS && !remaining.empty(); l++) {
+    uint64_t numBlocks = ((uint64_t) (GAMMA * remaining.size()) + BLOCK_BITS) / BLOCK_BITS;
+    uint64_t numBits = numBlocks * BLOCK_BITS;
+
+    // count keys per position, saturating at 2
+    vector<unsigned char> counts(numBits, 0);
+    vector<uint64_t>::iterator it;
+    for (it = remaining.begin(); it != remaining.end(); ++it) {
+      unsigned char& count = counts[levelPosition(hashes[*it], l, numBits)];
+      if (count < 2) {
+        count++;
+      }
+    }
+
+    // positions hit by exactly one key are set
+    vector<Block> blocks(numBlocks);
+    memset(&blocks[0], 0, numBlocks * sizeof(Block));
+    for (uint64_t p = 0; p < numBits; p++) {
+      if (counts[p] == 1) {
+        uint64_t offset = p % BLOCK_BITS;
+        blocks[p / BLOCK_BITS].bits[offset / 64] |= 1ULL << (offset % 64);
+      }
+    }
+
+    uint64_t rank = 0;
+    for (uint64_t b = 0; b < numBlocks; b++) {
+      blocks[b].rank = rank;
+      for (int w = 0; w < 7; w++) {
+        rank += __builtin_popcountll(blocks[b].bits[w]);
+      }
+    }
+
+    vector<uint64_t> next;
+    for (it = remaining.begin(); it != remaining.end(); ++it) {
+      uint64_t p = levelPosition(hashes[*it], l, numBits);
+      if (counts[p] != 1) {
+        next.push_back(*it);
+        continue;
+      }
+
+      const Block& block = blocks[p / BLOCK_BITS];
+      uint64_t offset = p % BLOCK_BITS;
+      uint64_t keyRank = block.rank;
+      for (uint64_t w = 0; w < offset / 64; w++) {
+        keyRank += __builtin_popcountll(block.bits[w]);
+      }
+      keyRank += __builtin_popcountll(block.bits[offset / 64] & ((1ULL << (offset % 64)) - 1));
+      slots[*it] = slotBase + keyRank;
+    }
+
+    Level level;
+    level.numBits = numBits;
+    level.blocksOffset = 0;
+    level.slotBase = slotBase;
+    levels.push_back(level);
+    levelBlocks.push_back(vector<Block>());
+    levelBlocks.back().swap(blocks);
+
+    slotBase += rank;
+    remaining.swap(next);
+  }
+
+  // whatever is left (identical 64-bit hashes, practically) goes to the fallback table
+  vector<Fallback> fallback;
+  vector<uint64_t>::iterator it;
+  for (it = remaining.begin(); it != remaining.end(); ++it) {
+    Fallback entry;
+    entry.hash = hashes[*it];
+    entry.slot = slotBase++;
+    slots[*it] = entry.slot;
+    fallback.push_back(entry);
+  }
+  stable_sort(fallback.begin(), fallback.end(), fallbackSort);
+
+  // records in slot order
+  vector<uint64_t> bySlot(numKeys);
+  for (uint64_t i = 0; i < numKeys; i++) {
+    bySlot[slots[i]] = i;
+  }
+
+  // lay out the sections
+  Header header;
+  memset(&header, 0, sizeof(Header));
+  memcpy(header.magic, MAGIC, sizeof(MAGIC));
+  header.version = VERSION;
+  header.numLevels = levels.size();
+  header.numKeys = numKeys;
+  header.numFallback = fallback.size();
+
+  uint64_t offset = sizeof(Header);
+  header.levelsOffset = offset;
+  offset += levels.size() * sizeof(Level);
+  header.fallbackOffset = offset;
+  offset += fallback.size() * sizeof(Fallback);
+
+  // blocks are cache line aligned so each probe touches one line
+  for (size_t l = 0; l < levels.size(); l++) {
+    offset = align(offset, sizeof(Block));
+    levels[l].blocksOffset = offset;
+    offset += levelBlocks[l].size() * sizeof(Block);
+  }
+
+  header.entriesOffset = offset;
+  offset += numKeys * sizeof(Entry);
+  header.keyIndexOffset = offset;
+  offset += numKeys * sizeof(uint64_t);
+  header.keysOffset = offset;
+
+  vector<Entry> entries(numKeys);
+  vector<uint64_t> keyIndex(numKeys);
+  uint64_t keyOffset = 0;
+  uint64_t valueOffset = 0;
+  for (uint64_t s = 0; s < numKeys; s++) {
+    pair<string, string>& record = _records[bySlot[s]];
+    entries[s].fingerprint = fingerprint(hashes[bySlot[s]]);
+    entries[s].valueSize = record.second.size();
+    entries[s].valueOffset = valueOffset;
+    keyIndex[s] = keyOffset;
+
+    keyOffset += record.first.size() + 1;
+    // keep every value 8-byte aligned so doubles can be read in place
+    valueOffset += align(record.second.size(), 8);
+  }
+  header.valuesOffset = align(header.keysOffset + keyOffset, 8);
+  header.fileSize = header.valuesOffset + valueOffset;
+
+  ofstream out(path.c_str(), ios::out | ios::binary | ios::trunc);
+  if (!out.is_open()) {
+    return false;
+  }
+
+  uint64_t pos = 0;
+  out.write((const char*) &header, sizeof(Header));
+  pos += sizeof(Header);
+  if (!levels.empty()) {
+    out.write((const char*) &levels[0], levels.size() * sizeof(Level));
+    pos += levels.size() * sizeof(Level);
+  }
+  if (!fallback.empty()) {
+    out.write((const char*) &fallback[0], fallback.size() * sizeof(Fallback));
+    pos += fallback.size() * sizeof(Fallback);
+  }
+  for (size_t l = 0; l < levels.size(); l++) {
+    pad(out, &pos, levels[l].blocksOffset);
+    out.write((const char*) &levelBlocks[l][0], levelBlocks[l].size() * sizeof(Block));
+    pos += levelBlocks[l].size() * sizeof(Block);
+  }
+  if (numKeys > 0) {
+    out.write((const char*) &entries[0], numKeys * sizeof(Entry));
+    out.write((const char*) &keyIndex[0], numKeys * sizeof(uint64_t));
+    pos += numKeys * (sizeof(Entry) + sizeof(uint64_t));
+  }
+  for (uint64_t s = 0; s < numKeys; s++) {
+    const string& key = _records[bySlot[s]].first;
+    out.write(key.c_str(), key.size() + 1);
+    pos += key.size() + 1;
+  }
+  for (uint64_t s = 0; s < numKeys; s++) {
+    const string& value = _records[bySlot[s]].second;
+    pad(out, &pos, header.valuesOffset + entries[s].valueOffset);
+    out.write(value.data(), value.size());
+    pos += value.size();
+  }
+  pad(out, &pos, header.fileSize);
+
+  out.close();
+  return !out.fail();
+}
+
+CompiledStore::CompiledStore(const string& path) : _base(NULL), _length(0) {
+  int fd = open(path.c_str(), O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    cerr << "Error opening compiled stats. Exiting." << path << endl;
+    exit(EXIT_FAILURE);
+  }
+  _length = st.st_size;
+
+  // read-only shared mapping; pages come from (and stay in) the page cache
+  void* mapping = mmap(NULL, _length, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (_length < sizeof(Header) || mapping == MAP_FAILED) {
+    cerr << "Error mapping compiled stats. Exiting." << path << endl;
+    exit(EXIT_FAILURE);
+  }
+  _base = (const char*) mapping;
+
+  // lookups jump around the file; don't bother reading ahead
+  madvise(mapping, _length, MADV_RANDOM);
+
+  _header = (const Header*) _base;
+  if (memcmp(_header->magic, MAGIC, sizeof(MAGIC)) != 0 || _header->version != VERSION
+      || _header->fileSize != _length || _header->numLevels > MAX_LEVELS) {
+    cerr << "Compiled stats " << path << " are corrupt or from another version; recompile them. Exiting."
+        << endl;
+    exit(EXIT_FAILURE);
+  }
+
+  _levels = (const Level*) (_base + _header->levelsOffset);
+  _fallback = (const Fallback*) (_base + _header->fallbackOffset);
+  _entries = (const Entry*) (_base + _header->entriesOffset);
+  _keyIndex = (const uint64_t*) (_base + _header->keyIndexOffset);
+  _keys = _base + _header->keysOffset;
+  _values = _base + _header->valuesOffset;
+}
+
+CompiledStore::~CompiledStore() {
+  if (_base) {
+    munmap((void*) _base, _length);
+  }
+}
+
+uint64_t CompiledStore::_slot(const char* key, uint64_t hash) const {
+  for (uint32_t l = 0; l < _header->numLevels; l++) {
+    const Level& level = _levels[l];
+    uint64_t p = levelPosition(hash, l, level.numBits);
+
+    const Block* block = (const Block*) (_base + level.blocksOffset) + p / BLOCK_BITS;
+    uint64_t offset = p % BLOCK_BITS;
+    uint64_t word = block->bits[offset / 64];
+    if (!((word >> (offset % 64)) & 1)) {
+      continue;
+    }
+
+    // slot is the # of set bits before p
+    uint64_t rank = block->rank;
+    for (uint64_t w = 0; w < offset / 64; w++) {
+      rank += __builtin_popcountll(block->bits[w]);
+    }
+    rank += __builtin_popcountll(word & ((1ULL << (offset % 64)) - 1));
+    return level.slotBase + rank;
+  }
+
+  // not placed by any level; check the keys that collided everywhere
+  Fallback probe;
+  probe.hash = hash;
+  const Fallback* end = _fallback + _header->numFallback;
+  for (const Fallback* f = lower_bound(_fallback, end, probe, fallbackSort); f != end && f->hash == hash; ++f) {
+    if (strcmp(keyAt(f->slot), key) == 0) {
+      return f->slot;
+    }
+  }
+  return _header->numKeys;
+}
+
+const void* CompiledStore::find(const char* key, u_int32_t* size) const {
+  uint64_t hash = hashKey(key, strlen(key));
+  uint64_t slot = _slot(key, hash);
+  if (slot >= _header->numKeys) {
+    return NULL;
+  }
+
+  // any key maps to some slot; the fingerprint tells whether it is the right one
+  const Entry& entry = _entries[slot];
+  if (entry.fingerprint != fingerprint(hash)) {
+    return NULL;
+  }
+
+  *size = entry.valueSize;
+  return _values + entry.valueOffset;
+}
+
+int CompiledStore::get(const char* key, void* val, u_int32_t size) const {
+  u_int32_t valueSize;
+  const void* value = find(key, &valueSize);
+  if (value == NULL) {
+    return 1;
+  }
+  memcpy(val, value, min(size, valueSize));
+  return 0;
+}
+
+uint64_t CompiledStore::numKeys() const {
+  return _header->numKeys;
+}
+
+const char* CompiledStore::keyAt(uint64_t i) const {
+  return _keys + _keyIndex[i];
+}
+
+const void* CompiledStore::valueAt(uint64_t i, u_int32_t* size) const {
+  *size = _entries[i].valueSize;
+  return _values + _entries[i].valueOffset;
+}
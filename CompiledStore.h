@@ -0,0 +1,128 @@
+/*
+ * CompiledStore.h
+ *
+ * Immutable, memory-mapped copy of a FeatureStore's freq.db/infreq.db pair for
+ * query time. Lookups return pointers straight into the mapping, and the pages
+ * are shared through the page cache by every process that maps the same file.
+ *
+ * Keys are located through a minimal perfect hash (BBHash style: a cascade of
+ * bit arrays, each holding the keys that didn't collide in the levels before it)
+ * plus a 32-bit fingerprint per key, so absent keys are rejected without
+ * touching the key strings. The hash itself takes about 4 bits per key.
+ *
+ *  Created on: Mar 11, 2014
+ *      Author: yubink
+ */
+
+#ifndef COMPILEDSTORE_H_
+#define COMPILEDSTORE_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <string>
+#include <vector>
+#include <utility>
+
+using namespace std;
+
+class CompiledStore {
+
+public:
+  static const char* FILE_NAME;
+  static const char MAGIC[8];
+  static const uint32_t VERSION = 2;
+  static const uint32_t MAX_LEVELS = 32;
+
+  // file layout: Header, Level[numLevels], Fallback[numFallback] sorted by hash,
+  // level bit arrays, Entry[numKeys] in hash slot order, key offsets, key strings,
+  // values (8-byte aligned)
+  struct Header {
+    char magic[8];
+    uint32_t version;
+    uint32_t numLevels;
+    uint64_t numKeys;
+    uint64_t numFallback;
+    uint64_t levelsOffset;
+    uint64_t fallbackOffset;
+    uint64_t entriesOffset;
+    uint64_t keyIndexOffset;
+    uint64_t keysOffset;
+    uint64_t valuesOffset;
+    uint64_t fileSize;
+  };
+
+  // one level of the hash; bits are stored in 64-byte blocks of a rank word
+  // (# of set bits in earlier blocks) followed by BLOCK_BITS bits
+  struct Level {
+    uint64_t numBits;
+    uint64_t blocksOffset;
+    uint64_t slotBase; // # of keys placed by earlier levels
+  };
+
+  struct Block {
+    uint64_t rank;
+    uint64_t bits[7];
+  };
+  static const uint64_t BLOCK_BITS = 7 * 64;
+
+  // keys that collided in every level; looked up by hash and then full key
+  struct Fallback {
+    uint64_t hash;
+    uint64_t slot;
+  };
+
+  struct Entry {
+    uint32_t fingerprint;
+    uint32_t valueSize;
+    uint64_t valueOffset; // relative to valuesOffset
+  };
+
+  // collects records in memory and writes them out as a compiled file
+  class Writer {
+
+  private:
+    vector<pair<string, string> > _records;
+
+  public:
+    void add(const char* key, const void* val, u_int32_t size);
+
+    // returns false if the file couldn't be written
+    bool write(const string& path);
+  };
+
+private:
+  const char* _base;
+  size_t _length;
+  const Header* _header;
+  const Level* _levels;
+  const Fallback* _fallback;
+  const Entry* _entries;
+  const uint64_t* _keyIndex;
+  const char* _keys;
+  const char* _values;
+
+public:
+  // maps the compiled file at path; exits if it isn't a valid compiled file
+  CompiledStore(const string& path);
+  virtual ~CompiledStore();
+
+  // returns a pointer to the value of key inside the mapping and its size in size;
+  // if key isn't found, returns NULL
+  const void* find(const char* key, u_int32_t* size) const;
+
+  // copies the value of key into val (at most size bytes); if key isn't found, returns non-zero
+  int get(const char* key, void* val, u_int32_t size) const;
+
+  // for walking all records (in hash slot order)
+  uint64_t numKeys() const;
+  const char* keyAt(uint64_t i) const;
+  const void* valueAt(uint64_t i, u_int32_t* size) const;
+
+  static uint64_t hashKey(const char* key, size_t length);
+
+private:
+  // hash slot of key, or numKeys if it can't be in the store
+  uint64_t _slot(const char* key, uint64_t hash) const;
+};
+
+#endif /* COMPILEDSTORE_H_ */
@@ -7,6 +7,10 @@
 
 #include "FeatureStore.h"
 #include <db_cxx.h>
+#include <iostream>
+#include <vector>
+#include <sys/stat.h>
+#include <algorithm>
 
 using namespace std;
 
@@ -15,32 +19,199 @@ const char* FeatureStore::SQUARED_FEAT_SUFFIX = "#f2";
 const char* FeatureStore::MIN_FEAT_SUFFIX = "#m";
 const char* FeatureStore::SIZE_FEAT_SUFFIX = "#d";
 const char* FeatureStore::TERM_SIZE_FEAT_SUFFIX = "#t";
+const char* FeatureStore::STATS_FEAT_SUFFIX = "#s";
+
+FeatureStore::FeatureStore(string dir, bool readOnly, int cache, DbEnv* env) : _freqDb(env, 0),
+    _infreqDb(env, 0), _dir(dir), _readOnly(readOnly), _cache(cache), _opened(false), _bulkLimit(0),
+    _bulkBytes(0), _env(env), _packed(false), _markerPending(false), _compiled(NULL) {
+  struct stat freqStat;
+
+  if (readOnly && _hasCompiled(dir)) {
+    // the dbs are never opened; everything is read from the mapping
+    _compiled = new CompiledStore(dir + "/" + CompiledStore::FILE_NAME);
+  } else if (readOnly || stat((dir + "/freq.db").c_str(), &freqStat) == 0) {
+    _open();
+  } else {
+    // a new store; its dbs are created on first use (see startBulkLoad)
+    return;
+  }
 
-FeatureStore::FeatureStore(string dir, bool readOnly, int cache) : _freqDb(NULL, 0),  _infreqDb(NULL, 0) {
-  string freqPath = dir + "/freq.db";
-  string infreqPath = dir + "/infreq.db";
-
-  u_int32_t flags = readOnly ? DB_RDONLY : DB_CREATE;
-
-  int freqCache = (cache/10 == 0) ? 1 : cache/10;
-
-  _openDb(freqPath.c_str(), &_freqDb, flags, freqCache);
-  _openDb(infreqPath.c_str(), &_infreqDb, flags, cache);
+  // a bare #s key marks stores whose per-term statistics are packed
+  double version;
+  _packed = (_get(STATS_FEAT_SUFFIX, &version, sizeof(double)) == 0);
 }
 
 FeatureStore::~FeatureStore() {
+  _writePackedMarker();
+  flush();
   _closeDb(&_freqDb);
   _closeDb(&_infreqDb);
+  delete _compiled;
+}
+
+DbEnv* FeatureStore::openEnv(int cache) {
+  DbEnv* env = new DbEnv(0);
+  try {
+    int gigs = cache/1024;
+    cache -= gigs*1024;
+    env->set_cachesize(gigs, cache*1024*1024, 0);
+    // no logging, locking or transactions; just the memory pool, kept in this process' heap
+    // and usable from several threads
+    env->open(NULL, DB_CREATE | DB_INIT_MPOOL | DB_PRIVATE | DB_THREAD, 0);
+  } catch (DbException &e) {
+    cerr << "Error opening DB environment. Exiting." << endl << e.what() << endl;
+    exit(EXIT_FAILURE);
+  }
+  return env;
+}
+
+void FeatureStore::closeEnv(DbEnv* env) {
+  if (env == NULL) {
+    return;
+  }
+  try {
+    env->close(0);
+  } catch (DbException &e) {
+    cerr << "Error while closing DB environment." << endl << e.what() << endl;
+  }
+  delete env;
+}
+
+// true if a was modified after b; to the nanosecond, since a db can be written in the same second as it was compiled
+static bool modifiedAfter(const struct stat& a, const struct stat& b) {
+  return a.st_mtim.tv_sec > b.st_mtim.tv_sec
+      || (a.st_mtim.tv_sec == b.st_mtim.tv_sec && a.st_mtim.tv_nsec > b.st_mtim.tv_nsec);
+}
+
+bool FeatureStore::_hasCompiled(const string& dir) {
+  struct stat compiledStat, freqStat, infreqStat;
+  if (stat((dir + "/" + CompiledStore::FILE_NAME).c_str(), &compiledStat) != 0) {
+    return false;
+  }
+
+  // don't serve stale stats if a db was written after compiling
+  if ((stat((dir + "/freq.db").c_str(), &freqStat) == 0 && modifiedAfter(freqStat, compiledStat))
+      || (stat((dir + "/infreq.db").c_str(), &infreqStat) == 0 && modifiedAfter(infreqStat, compiledStat))) {
+    cerr << "Compiled stats in " << dir << " are older than its dbs; ignoring them." << endl;
+    return false;
+  }
+  return true;
 }
 
 int FeatureStore::getFeature(char* keyStr, double* val) {
+  return _get(keyStr, val, sizeof(double));
+}
+
+void FeatureStore::_open(u_int32_t freqRecords, u_int32_t infreqRecords) {
+  string freqPath = _dir + "/freq.db";
+  string infreqPath = _dir + "/infreq.db";
+
+  // read-only handles may be used by several threads at once
+  u_int32_t flags = _readOnly ? DB_RDONLY | DB_THREAD : DB_CREATE;
+
+  int freqCache = (_cache/10 == 0) ? 1 : _cache/10;
+
+  _openDb(freqPath.c_str(), &_freqDb, flags, freqCache, freqRecords);
+  _openDb(infreqPath.c_str(), &_infreqDb, flags, _cache, infreqRecords);
+  _opened = true;
+}
+
+void FeatureStore::_ensureOpen() {
+  // reads have to see buffered records
+  flush();
+  if (!_opened) {
+    _open();
+  }
+}
+
+void FeatureStore::startBulkLoad(int bufferSize) {
+  _bulkLimit = (size_t) bufferSize * 1024 * 1024;
+}
+
+void FeatureStore::flush() {
+  if (_bulk[0].empty() && _bulk[1].empty() && _bulkAdds.empty()) {
+    return;
+  }
+
+  // size new hash tables for the whole first batch, so they never have to split while it goes in
+  if (!_opened) {
+    _open(_bulk[0].size(), _bulk[1].size());
+  }
+
+  Db* dbs[] = { &_freqDb, &_infreqDb };
+  for (int d = 0; d < 2; d++) {
+    vector<BulkRecord>::iterator it;
+    for (it = _bulk[d].begin(); it != _bulk[d].end(); ++it) {
+      Dbt key((void*) it->key.c_str(), it->key.size() + 1);
+      Dbt data((void*) it->value.data(), it->value.size());
+
+      int ret = dbs[d]->put(NULL, &key, &data, it->flags);
+      if (ret == DB_KEYEXIST) {
+        dbs[d]->err(ret, "Put failed because key %s already exists", it->key.c_str());
+      }
+    }
+    // release the memory, not just the elements
+    vector<BulkRecord>().swap(_bulk[d]);
+  }
+
+  // one read-modify-write per distinct key, however many adds it got
+  boost::unordered_map<string, BulkAdd>::iterator it;
+  for (it = _bulkAdds.begin(); it != _bulkAdds.end(); ++it) {
+    _addVal(it->first.c_str(), it->second.val, it->second.frequency);
+  }
+  boost::unordered_map<string, BulkAdd>().swap(_bulkAdds);
+  _bulkBytes = 0;
+}
+
+void FeatureStore::_put(const char* keyStr, const void* val, u_int32_t size, int frequency, int flags) {
+  int d = (frequency >= FREQUENT_TERMS) ? 0 : 1;
+
+  if (_bulkLimit > 0) {
+    BulkRecord record;
+    record.key = keyStr;
+    record.value.assign((const char*) val, size);
+    record.flags = flags;
+    _bulk[d].push_back(record);
+
+    // rough footprint of the record, including string and vector overhead
+    _bulkBytes += record.key.size() + size + sizeof(BulkRecord) + 32;
+    if (_bulkBytes >= _bulkLimit) {
+      flush();
+    }
+    return;
+  }
+
+  if (!_opened) {
+    _open();
+  }
+  _putDirect(keyStr, val, size, frequency, flags);
+}
+
+void FeatureStore::_putDirect(const char* keyStr, const void* val, u_int32_t size, int frequency, int flags) {
+  Db* db = (frequency >= FREQUENT_TERMS) ? &_freqDb : &_infreqDb;
+  Dbt key((void*) keyStr, strlen(keyStr) + 1);
+  Dbt data((void*) val, size);
+
+  int ret = db->put(NULL, &key, &data, flags);
+  if (ret == DB_KEYEXIST) {
+    db->err(ret, "Put failed because key %s already exists", keyStr);
+  }
+}
+
+int FeatureStore::_get(const char* keyStr, void* val, u_int32_t size) {
+  if (_compiled) {
+    return _compiled->get(keyStr, val, size);
+  }
+
+  _ensureOpen();
+
   Dbt key, data;
 
-  key.set_data(keyStr);
+  key.set_data((void*) keyStr);
   key.set_size(strlen(keyStr) + 1);
 
   data.set_data(val);
-  data.set_ulen(sizeof(double));
+  data.set_ulen(size);
   data.set_flags(DB_DBT_USERMEM);
 
   int retval = _freqDb.get(NULL, &key, &data, 0);
@@ -55,28 +226,138 @@ int FeatureStore::getFeature(char* keyStr, double* val) {
   return 0;
 }
 
-void FeatureStore::putFeature(char* stem, double val, int frequency, int flags) {
-  Dbt key(stem, strlen(stem) + 1);
-  Dbt data(&val, sizeof(double));
+// orders positions in a key list by the keys they point to
+class KeyOrder {
+  const vector<string>& _keys;
+public:
+  KeyOrder(const vector<string>& keys) : _keys(keys) {}
+  bool operator()(size_t i, size_t j) const {
+    return _keys[i] < _keys[j];
+  }
+};
+
+int FeatureStore::_getMany(const vector<string>& keys, char* vals, u_int32_t size, vector<bool>* found) {
+  size_t numKeys = keys.size();
+  found->assign(numKeys, false);
 
-  Db* db;
-  if (frequency >= FREQUENT_TERMS) {
-    db = &_freqDb;
+  vector<size_t> order(numKeys);
+  for (size_t i = 0; i < numKeys; i++) {
+    order[i] = i;
+  }
+  sort(order.begin(), order.end(), KeyOrder(keys));
+
+  // first position of every distinct key; the other positions get a copy at the end
+  vector<size_t> unique;
+  for (size_t i = 0; i < numKeys; i++) {
+    if (i == 0 || keys[order[i]] != keys[order[i-1]]) {
+      unique.push_back(order[i]);
+    }
+  }
+
+  vector<size_t> misses;
+  if (_compiled) {
+    vector<size_t>::iterator it;
+    for (it = unique.begin(); it != unique.end(); ++it) {
+      (*found)[*it] = (_compiled->get(keys[*it].c_str(), vals + *it * size, size) == 0);
+    }
   } else {
-    db = &_infreqDb;
+    _ensureOpen();
+
+    Dbt key, data;
+    data.set_ulen(size);
+    data.set_flags(DB_DBT_USERMEM);
+
+    Db* dbs[] = { &_freqDb, &_infreqDb };
+    vector<size_t>* pending = &unique;
+    for (int d = 0; d < 2; d++) {
+      vector<size_t> next;
+      vector<size_t>::iterator it;
+      for (it = pending->begin(); it != pending->end(); ++it) {
+        key.set_data((void*) keys[*it].c_str());
+        key.set_size(keys[*it].size() + 1);
+        data.set_data(vals + *it * size);
+
+        if (dbs[d]->get(NULL, &key, &data, 0) == 0) {
+          (*found)[*it] = true;
+        } else {
+          next.push_back(*it);
+        }
+      }
+      misses.swap(next);
+      pending = &misses;
+    }
   }
 
-  int ret = db->put(NULL, &key, &data, flags);
-  if (ret == DB_KEYEXIST) {
-    db->err(ret, "Put failed because key %s already exists", stem);
+  // fill in the duplicates
+  int foundCnt = 0;
+  size_t first = order.empty() ? 0 : order[0];
+  for (size_t i = 0; i < numKeys; i++) {
+    size_t pos = order[i];
+    if (keys[pos] != keys[first]) {
+      first = pos;
+    } else if (pos != first) {
+      (*found)[pos] = (*found)[first];
+      memcpy(vals + pos * size, vals + first * size, size);
+    }
+    if ((*found)[pos]) {
+      foundCnt++;
+    }
+  }
+  return foundCnt;
+}
+
+int FeatureStore::getFeatures(const vector<string>& keys, vector<double>* values, vector<bool>* found) {
+  values->assign(keys.size(), 0.0);
+  if (keys.empty()) {
+    found->clear();
+    return 0;
   }
+  return _getMany(keys, (char*) &(*values)[0], sizeof(double), found);
+}
+
+bool FeatureStore::_makeKey(const char* stem, const char* suffix, char* buf) {
+  size_t stemLen = strlen(stem);
+  size_t suffixLen = strlen(suffix);
+  if (stemLen + suffixLen > MAX_TERM_SIZE) {
+    return false;
+  }
+  memcpy(buf, stem, stemLen);
+  memcpy(buf + stemLen, suffix, suffixLen + 1);
+  return true;
+}
+
+void FeatureStore::putFeature(char* stem, double val, int frequency, int flags) {
+  _put(stem, &val, sizeof(double), frequency, flags);
 }
 
 void FeatureStore::addValFeature(char* keyStr, double val, int frequency) {
+  if (_bulkLimit > 0) {
+    pair<boost::unordered_map<string, BulkAdd>::iterator, bool> added =
+        _bulkAdds.insert(make_pair(string(keyStr), BulkAdd()));
+    if (added.second) {
+      added.first->second.val = val;
+      added.first->second.frequency = frequency;
+
+      // rough footprint of the entry, including the node and string overhead
+      _bulkBytes += added.first->first.size() + sizeof(BulkAdd) + 64;
+      if (_bulkBytes >= _bulkLimit) {
+        flush();
+      }
+    } else {
+      added.first->second.val += val;
+    }
+    return;
+  }
+
+  _ensureOpen();
+  _addVal(keyStr, val, frequency);
+}
+
+void FeatureStore::_addVal(const char* keyStr, double val, int frequency) {
   double prevVal;
 
   Dbt key, data;
-  key.set_data(keyStr);
+  key.set_data((void*) keyStr);
   key.set_size(strlen(keyStr) + 1);
 
   data.set_data(&prevVal);
@@ -96,19 +377,342 @@ void FeatureStore::addValFeature(char* keyStr, double val, int frequency) {
     frequency = FREQUENT_TERMS + 1;
   }
 
-  putFeature(keyStr, val+prevVal, frequency, 0);
+  double sum = val + prevVal;
+  _putDirect(keyStr, &sum, sizeof(double), frequency, 0);
+}
+
+void FeatureStore::putTermStats(const char* stem, const TermStats& stats, int frequency, int flags) {
+  // the #s marker is only written once every record is in (see _writePackedMarker), so an
+  // interrupted build or pack never leaves a store that claims to be packed but isn't
+  _packed = true;
+  _markerPending = true;
+
+  char keyStr[MAX_TERM_SIZE + 1];
+  if (!_makeKey(stem, STATS_FEAT_SUFFIX, keyStr)) {
+    cerr << "Term too long to store: " << stem << endl;
+    return;
+  }
+
+  _put(keyStr, &stats, sizeof(TermStats), frequency, flags);
+}
+
+int FeatureStore::getTermStats(const char* stem, TermStats* stats) {
+  if (!_packed) {
+    return _getLegacyTermStats(stem, stats);
+  }
+
+  char keyStr[MAX_TERM_SIZE + 1];
+  if (!_makeKey(stem, STATS_FEAT_SUFFIX, keyStr)) {
+    return 1;
+  }
+  return _get(keyStr, stats, sizeof(TermStats));
+}
+
+int FeatureStore::getTermStats(const vector<string>& stems, vector<TermStats>* stats, vector<bool>* found) {
+  size_t numStems = stems.size();
+  stats->assign(numStems, TermStats());
+  if (numStems == 0) {
+    found->clear();
+    return 0;
+  }
+
+  if (_packed) {
+    vector<string> keys(stems);
+    vector<string>::iterator it;
+    for (it = keys.begin(); it != keys.end(); ++it) {
+      it->append(STATS_FEAT_SUFFIX);
+    }
+    return _getMany(keys, (char*) &(*stats)[0], sizeof(TermStats), found);
+  }
+
+  // unpacked stores: a stem exists if its #d does, so fetch those first and then
+  // the other three features of the stems that were found
+  vector<string> keys;
+  for (size_t i = 0; i < numStems; i++) {
+    keys.push_back(stems[i] + SIZE_FEAT_SUFFIX);
+  }
+  vector<double> dfs;
+  int foundCnt = getFeatures(keys, &dfs, found);
+
+  const char* legacySuffixes[] = { FEAT_SUFFIX, SQUARED_FEAT_SUFFIX, MIN_FEAT_SUFFIX };
+  vector<size_t> present;
+  keys.clear();
+  for (size_t i = 0; i < numStems; i++) {
+    if ((*found)[i]) {
+      (*stats)[i].df = dfs[i];
+      present.push_back(i);
+    }
+  }
+  for (int f = 0; f < 3; f++) {
+    for (size_t p = 0; p < present.size(); p++) {
+      keys.push_back(stems[present[p]] + legacySuffixes[f]);
+    }
+  }
+
+  vector<double> values;
+  vector<bool> featFound;
+  getFeatures(keys, &values, &featFound);
+
+  // missing features keep their defaults
+  size_t numPresent = present.size();
+  for (size_t p = 0; p < numPresent; p++) {
+    TermStats& s = (*stats)[present[p]];
+    if (featFound[p]) {
+      s.f = values[p];
+    }
+    if (featFound[numPresent + p]) {
+      s.f2 = values[numPresent + p];
+    }
+    if (featFound[2*numPresent + p]) {
+      s.min = values[2*numPresent + p];
+    }
+  }
+  return foundCnt;
+}
+
+int FeatureStore::_getLegacyTermStats(const char* stem, TermStats* stats) {
+  char keyStr[MAX_TERM_SIZE + 1];
+  *stats = TermStats();
+
+  if (!_makeKey(stem, SIZE_FEAT_SUFFIX, keyStr) || _get(keyStr, &stats->df, sizeof(double)) != 0) {
+    return 1;
+  }
+  if (_makeKey(stem, FEAT_SUFFIX, keyStr)) {
+    _get(keyStr, &stats->f, sizeof(double));
+  }
+  if (_makeKey(stem, SQUARED_FEAT_SUFFIX, keyStr)) {
+    _get(keyStr, &stats->f2, sizeof(double));
+  }
+  if (_makeKey(stem, MIN_FEAT_SUFFIX, keyStr)) {
+    _get(keyStr, &stats->min, sizeof(double));
+  }
+  return 0;
+}
+
+long FeatureStore::packTermStats() {
+  const char* legacySuffixes[] = { SIZE_FEAT_SUFFIX, FEAT_SUFFIX, SQUARED_FEAT_SUFFIX, MIN_FEAT_SUFFIX };
+  size_t sizeSuffixLen = strlen(SIZE_FEAT_SUFFIX);
+
+  _ensureOpen();
+
+  Db* dbs[] = { &_freqDb, &_infreqDb };
+  int frequencies[] = { FREQUENT_TERMS, FREQUENT_TERMS - 1 };
+
+  char keyStr[MAX_TERM_SIZE+1];
+  vector<string> packed[2]; // stems packed in each db
+
+  long packedCnt = 0;
+  for (int d = 0; d < 2; d++) {
+    // collect the stems first; writing to a hash db while a cursor walks it can revisit records
+    vector<string> stems;
+
+    double val;
+
+    Dbt key, data;
+    key.set_data(keyStr);
+    key.set_ulen(MAX_TERM_SIZE+1);
+    key.set_flags(DB_DBT_USERMEM);
+
+    data.set_data(&val);
+    data.set_ulen(sizeof(double));
+    data.set_flags(DB_DBT_USERMEM);
+
+    Dbc* cursor;
+    dbs[d]->cursor(NULL, &cursor, 0);
+    while (cursor->get(&key, &data, DB_NEXT) == 0) {
+      size_t keyLen = strlen(keyStr);
+
+      // every stem of a shard has a #d key; the bare #d key is the shard size
+      if (keyLen > sizeSuffixLen && strcmp(keyStr + keyLen - sizeSuffixLen, SIZE_FEAT_SUFFIX) == 0) {
+        stems.push_back(string(keyStr, keyLen - sizeSuffixLen));
+      }
+    }
+    cursor->close();
+
+    vector<string>::iterator it;
+    for (it = stems.begin(); it != stems.end(); ++it) {
+      TermStats stats;
+      _getLegacyTermStats(it->c_str(), &stats);
+
+      // corpus-wide dbs also have stem#d keys but no feature sums; leave those alone
+      double fSum;
+      _makeKey(it->c_str(), FEAT_SUFFIX, keyStr);
+      if (_get(keyStr, &fSum, sizeof(double)) != 0) {
+        continue;
+      }
+
+      putTermStats(it->c_str(), stats, frequencies[d], 0);
+      packed[d].push_back(*it);
+
+      packedCnt++;
+      if (packedCnt % 100000 == 0) {
+        cout << "  Packed " << packedCnt << " terms" << endl;
+      }
+    }
+  }
+
+  // the legacy keys are only dropped once every packed record and the marker are in; until
+  // then an interrupted pack leaves a store that is still read the legacy way
+  _writePackedMarker();
+  for (int d = 0; d < 2; d++) {
+    vector<string>::iterator it;
+    for (it = packed[d].begin(); it != packed[d].end(); ++it) {
+      for (int i = 0; i < 4; i++) {
+        _makeKey(it->c_str(), legacySuffixes[i], keyStr);
+        Dbt delKey(keyStr, strlen(keyStr) + 1);
+        dbs[d]->del(NULL, &delKey, 0);
+      }
+    }
+  }
+
+  return packedCnt;
+}
+
+long FeatureStore::rerouteCorpusStats() {
+  const char* suffixes[] = { TERM_SIZE_FEAT_SUFFIX, SIZE_FEAT_SUFFIX };
+  size_t ctfSuffixLen = strlen(TERM_SIZE_FEAT_SUFFIX);
+
+  _ensureOpen();
+
+  Db* dbs[] = { &_freqDb, &_infreqDb };
+  int frequencies[] = { FREQUENT_TERMS, FREQUENT_TERMS - 1 };
+
+  char keyStr[MAX_TERM_SIZE+1];
+
+  long movedCnt = 0;
+  for (int d = 0; d < 2; d++) {
+    // collect the stems first; writing to a hash db while a cursor walks it can revisit records
+    vector<string> stems;
+
+    double val;
+
+    Dbt key, data;
+    key.set_data(keyStr);
+    key.set_ulen(MAX_TERM_SIZE+1);
+    key.set_flags(DB_DBT_USERMEM);
+
+    data.set_data(&val);
+    data.set_ulen(sizeof(double));
+    data.set_flags(DB_DBT_USERMEM);
+
+    Dbc* cursor;
+    dbs[d]->cursor(NULL, &cursor, 0);
+    while (cursor->get(&key, &data, DB_NEXT) == 0) {
+      size_t keyLen = strlen(keyStr);
+
+      // the bare #t key is the corpus size and stays in the frequent db
+      if (keyLen > ctfSuffixLen && strcmp(keyStr + keyLen - ctfSuffixLen, TERM_SIZE_FEAT_SUFFIX) == 0
+          && (val >= FREQUENT_TERMS) != (d == 0)) {
+        stems.push_back(string(keyStr, keyLen - ctfSuffixLen));
+      }
+    }
+    cursor->close();
+
+    vector<string>::iterator it;
+    for (it = stems.begin(); it != stems.end(); ++it) {
+      for (int i = 0; i < 2; i++) {
+        _makeKey(it->c_str(), suffixes[i], keyStr);
+        Dbt moveKey(keyStr, strlen(keyStr) + 1);
+        if (dbs[d]->get(NULL, &moveKey, &data, 0) != 0) {
+          continue;
+        }
+        _putDirect(keyStr, &val, sizeof(double), frequencies[1 - d], 0);
+        dbs[d]->del(NULL, &moveKey, 0);
+      }
+
+      movedCnt++;
+      if (movedCnt % 100000 == 0) {
+        cout << "  Moved " << movedCnt << " terms" << endl;
+      }
+    }
+  }
+
+  return movedCnt;
+}
+
+void FeatureStore::_writePackedMarker() {
+  if (!_markerPending) {
+    return;
+  }
+  double version = 1.0;
+  putFeature((char*) STATS_FEAT_SUFFIX, version, FREQUENT_TERMS + 1, 0);
+  _markerPending = false;
 }
 
 FeatureStore::TermIterator* FeatureStore::getTermIterator() {
+  if (_compiled) {
+    return new FeatureStore::TermIterator(_compiled);
+  }
+  _ensureOpen();
   return new FeatureStore::TermIterator(&_freqDb, &_infreqDb);
 }
 
-void FeatureStore::_openDb(const char* dbPath, Db* db, u_int32_t oFlags, int cache) {
+FeatureStore::TermIterator* FeatureStore::getTermStatsIterator() {
+  if (_compiled) {
+    return new FeatureStore::TermIterator(_compiled, STATS_FEAT_SUFFIX);
+  }
+  _ensureOpen();
+  return new FeatureStore::TermIterator(&_freqDb, &_infreqDb, STATS_FEAT_SUFFIX);
+}
+
+bool FeatureStore::isPacked() {
+  return _packed;
+}
+
+bool FeatureStore::compile(const string& path) {
+  if (_compiled) {
+    cerr << "Store is already served from a compiled file; can't compile it again." << endl;
+    return false;
+  }
+
+  _writePackedMarker();
+  _ensureOpen();
+
+  CompiledStore::Writer writer;
+
+  char keyStr[MAX_TERM_SIZE+1];
+  TermStats val; // large enough for both single feature values and packed records
+
+  Dbt key, data;
+  key.set_data(keyStr);
+  key.set_ulen(MAX_TERM_SIZE+1);
+  key.set_flags(DB_DBT_USERMEM);
+
+  data.set_data(&val);
+  data.set_ulen(sizeof(TermStats));
+  data.set_flags(DB_DBT_USERMEM);
+
+  Db* dbs[] = { &_freqDb, &_infreqDb };
+  long keyCnt = 0;
+  for (int d = 0; d < 2; d++) {
+    Dbc* cursor;
+    dbs[d]->cursor(NULL, &cursor, 0);
+    while (cursor->get(&key, &data, DB_NEXT) == 0) {
+      writer.add(keyStr, &val, data.get_size());
+
+      keyCnt++;
+      if (keyCnt % 1000000 == 0) {
+        cout << "  Read " << keyCnt << " keys" << endl;
+      }
+    }
+    cursor->close();
+  }
+
+  return writer.write(path);
+}
+
+void FeatureStore::_openDb(const char* dbPath, Db* db, u_int32_t oFlags, int cache, u_int32_t numRecords) {
   try {
-    int gigs = cache/1024;
-    cache -= gigs*1024;
-    // set cache size
-    db->set_cachesize(gigs, cache*1024*1024, 0);
+    // only used when the db is created
+    if (numRecords > 0) {
+      db->set_h_nelem(numRecords);
+    }
+    // set cache size; dbs in a shared environment use its cache
+    if (_env == NULL) {
+      int gigs = cache/1024;
+      cache -= gigs*1024;
+      db->set_cachesize(gigs, cache*1024*1024, 0);
+    }
     // Open the database
     db->open(NULL, // Transaction pointer
         dbPath, // Database file name
@@ -135,10 +739,20 @@ void FeatureStore::_closeDb(Db* db) {
   }
 }
 
-FeatureStore::TermIterator::TermIterator(Db* freqDb, Db* infreqDb): _freqDb(freqDb),
-    _infreqDb(infreqDb), _finished(false), _current() {
+FeatureStore::TermIterator::TermIterator(Db* freqDb, Db* infreqDb, const char* suffix): _freqDb(freqDb),
+    _infreqDb(infreqDb), _compiled(NULL), _compiledPos(0), _suffix(suffix), _finished(false), _current(),
+    _currentStats() {
   _freqDb->cursor(NULL, &_freqCursor, 0);
   _infreqCursor = NULL;
+
+  // position on the first entry so currrentEntry() is valid right away
+  nextTerm();
+}
+
+FeatureStore::TermIterator::TermIterator(const CompiledStore* compiled, const char* suffix): _freqDb(NULL),
+    _infreqDb(NULL), _freqCursor(NULL), _infreqCursor(NULL), _compiled(compiled), _compiledPos(0),
+    _suffix(suffix), _finished(false), _current(), _currentStats() {
+  nextTerm();
 }
 
 FeatureStore::TermIterator::~TermIterator() {
@@ -150,9 +764,39 @@ FeatureStore::TermIterator::~TermIterator() {
   }
 }
 
+bool FeatureStore::TermIterator::_setCurrent(const char* keyStr, const TermStats& val) {
+  string stemKey(keyStr);
+  size_t idx = stemKey.find(_suffix);
+
+  // is it a stem ctf key value pair? (there is a #t key for the term count in entire corpus)
+  if (idx != string::npos && idx != 0) {
+    // (string::size_type) there to make eclipse c++ static analyzer happy.
+    string stem = stemKey.substr((string::size_type)0, stemKey.size() - strlen(_suffix));
+    _current = make_pair(stem, val.df);
+    _currentStats = val;
+    return true;
+  }
+  return false;
+}
+
 void FeatureStore::TermIterator::nextTerm() {
+  if (_compiled) {
+    while (_compiledPos < _compiled->numKeys()) {
+      u_int32_t size;
+      TermStats val;
+      const void* value = _compiled->valueAt(_compiledPos, &size);
+      memcpy(&val, value, min((size_t) size, sizeof(TermStats)));
+
+      if (_setCurrent(_compiled->keyAt(_compiledPos++), val)) {
+        return;
+      }
+    }
+    _finished = true;
+    return;
+  }
+
   char keyStr[MAX_TERM_SIZE+1];
-  double val;
+  TermStats val; // large enough for both single feature values and packed records
 
   Dbt key, data;
   key.set_data(keyStr);
@@ -160,7 +804,7 @@ void FeatureStore::TermIterator::nextTerm() {
   key.set_flags(DB_DBT_USERMEM);
 
   data.set_data(&val);
-  data.set_ulen(sizeof(double));
+  data.set_ulen(sizeof(TermStats));
   data.set_flags(DB_DBT_USERMEM);
 
   int ret;
@@ -182,17 +826,8 @@ void FeatureStore::TermIterator::nextTerm() {
         _infreqCursor = NULL;
         break;
       }
-    } else {
-      string stemKey(keyStr);
-      size_t idx = stemKey.find(TERM_SIZE_FEAT_SUFFIX);
-
-      // is it a stem ctf key value pair? (there is a #t key for the term count in entire corpus)
-      if (idx != string::npos && idx != 0) {
-        // (string::size_type) there to make eclipse c++ static analyzer happy.
-        string stem = stemKey.substr((string::size_type)0, stemKey.size() - strlen(TERM_SIZE_FEAT_SUFFIX));
-        _current = make_pair(stem, val);
-        break;
-      }
+    } else if (_setCurrent(keyStr, val)) {
+      break;
     }
   }
 }
@@ -204,3 +839,7 @@ bool FeatureStore::TermIterator::finished() {
 pair<string, double> FeatureStore::TermIterator::currrentEntry() {
   return _current;
 }
+
+const FeatureStore::TermStats& FeatureStore::TermIterator::currentTermStats() {
+  return _currentStats;
+}
@@ -11,8 +11,13 @@
 #define FEATURESTORE_H_
 
 #include <db_cxx.h>
+#include "CompiledStore.h"
 #include <string.h>
 #include <stdlib.h>
+#include <float.h>
+#include <string>
+#include <vector>
+#include <boost/unordered_map.hpp>
 
 using namespace std;
 
@@ -28,9 +33,21 @@ public:
   static const char* MIN_FEAT_SUFFIX;
   static const char* SIZE_FEAT_SUFFIX;
   static const char* TERM_SIZE_FEAT_SUFFIX;
+  static const char* STATS_FEAT_SUFFIX;
   static const int FREQUENT_TERMS = 1000; // tf required for a term to be considered "frequent"
   static const uint MAX_TERM_SIZE = 512;
 
+  // all per-term statistics of a shard; stored as one fixed-size record under the stem#s key
+  // so that a single probe replaces the separate #d, #f, #f2 and #m lookups
+  struct TermStats {
+    double df; // # of docs in the shard that contain the term
+    double f; // sum of the term's features
+    double f2; // sum of the term's squared features
+    double min; // minimum feature of the term
+
+    TermStats(): df(0.0), f(0.0), f2(0.0), min(DBL_MAX) {};
+  };
+
 public:
   class TermIterator {
 
@@ -39,36 +56,155 @@ public:
     Db* _infreqDb;
     Dbc* _freqCursor;
     Dbc* _infreqCursor;
+    const CompiledStore* _compiled; // walked instead of the dbs if not NULL
+    uint64_t _compiledPos;
+    const char* _suffix; // only keys of the form stem+suffix are visited
     bool _finished;
     pair<string, double> _current;
+    TermStats _currentStats;
 
   public:
-    TermIterator(Db* freqDb, Db* infreqDb);
+    TermIterator(Db* freqDb, Db* infreqDb, const char* suffix = TERM_SIZE_FEAT_SUFFIX);
+    TermIterator(const CompiledStore* compiled, const char* suffix = TERM_SIZE_FEAT_SUFFIX);
     virtual ~TermIterator();
     void nextTerm();
     bool finished();
 
     // returns a stem and its df (# of documents that contain it)
     pair<string, double> currrentEntry();
+
+    // returns the packed statistics of the current stem; only for iterators from getTermStatsIterator
+    const TermStats& currentTermStats();
+
+  private:
+    // sets the current entry if key is stem+suffix; returns false otherwise
+    bool _setCurrent(const char* key, const TermStats& val);
   };
 
   // cache size is in megabytes
-  FeatureStore(string dir,  bool readOnly = false, int cache = 1);
+  // read-only stores are served from the compiled file (see compile) when the directory has an up to date one
+  // if env is given, the dbs are opened in it and share its cache instead; cache is then ignored
+  // read-only stores may be read from several threads at once; writable ones may not
+  FeatureStore(string dir,  bool readOnly = false, int cache = 1, DbEnv* env = NULL);
   virtual ~FeatureStore();
 
+  // opens a process-private environment with a single cache of the given size (in megabytes)
+  // for many stores to share; close it with closeEnv only after deleting every store opened in it
+  static DbEnv* openEnv(int cache);
+  static void closeEnv(DbEnv* env);
+
   void putFeature(char* key, double value, int frequency, int flags = DB_NOOVERWRITE);
 
   // returns feature in value; if feature isn't found, returns non-zero
   int getFeature(char* key, double* value);
 
+  // looks up a batch of features; values[i] and found[i] belong to keys[i]
+  // duplicate keys are looked up once; returns the # of keys found
+  int getFeatures(const vector<string>& keys, vector<double>* values, vector<bool>* found);
+
   // add val to the keyStr feature if it exists already; otherwise, create the feature
+  // during a bulk load, adds are summed per key in the buffer and applied to the stored values
+  // when it is flushed, after the buffered puts
   void addValFeature(char* keyStr, double val, int frequency);
 
+  // stores all statistics of stem as a single packed record
+  void putTermStats(const char* stem, const TermStats& stats, int frequency, int flags = DB_NOOVERWRITE);
+
+  // returns statistics of stem in stats; if stem isn't found, returns non-zero
+  // stores that haven't been packed yet are read from the separate #d, #f, #f2 and #m keys
+  int getTermStats(const char* stem, TermStats* stats);
+
+  // getTermStats for a batch of stems; stats[i] and found[i] belong to stems[i]; returns the # of stems found
+  int getTermStats(const vector<string>& stems, vector<TermStats>* stats, vector<bool>* found);
+
+  // rewrites the separate per-term keys of a shard store into packed records;
+  // returns the number of terms packed
+  long packTermStats();
+
+  // moves the #t and #d keys of every corpus-wide stem into the db its total ctf (the #t value)
+  // belongs in; stores built by adding up batches need this, since a stem's first batch decides
+  // where addValFeature puts it; returns the number of stems moved
+  long rerouteCorpusStats();
+
+  // iterates over stems of the corpus-wide store (stems with a #t key)
   TermIterator* getTermIterator();
 
+  // iterates over the packed statistics of every stem in a shard store
+  TermIterator* getTermStatsIterator();
+
+  bool isPacked();
+
+  // bulk loading for builds: puts are buffered in memory (up to bufferSize megabytes) and written
+  // in large batches; a new store creates its hash tables pre-sized for the first batch
+  // buffered records are written out before any read, on flush and when the store is deleted
+  void startBulkLoad(int bufferSize);
+  void flush();
+
+  // writes every record of both dbs into an immutable compiled file for read-only use;
+  // returns false if it couldn't be written
+  bool compile(const string& path);
+
 private:
-  void _openDb(const char* dbPath, Db* db, u_int32_t oFlags, int cache = 5);
+  // a record waiting to be written by a bulk load
+  struct BulkRecord {
+    string key;
+    string value;
+    int flags;
+  };
+
+  string _dir;
+  bool _readOnly;
+  int _cache;
+  bool _opened; // false until the dbs are opened; new stores open them on first use
+
+  // a sum waiting to be added to a stored feature by a bulk load
+  struct BulkAdd {
+    double val;
+    int frequency; // of the first add; decides the db if the feature isn't stored yet
+  };
+
+  size_t _bulkLimit; // buffer size in bytes; 0 if not bulk loading
+  size_t _bulkBytes;
+  vector<BulkRecord> _bulk[2]; // records for the frequent and the infrequent db
+  boost::unordered_map<string, BulkAdd> _bulkAdds; // summed adds by key
+
+  DbEnv* _env; // shared environment the dbs live in; NULL if each db has its own cache
+  bool _packed; // true if per-term statistics are stored as packed records
+  bool _markerPending; // true if packed records were put but the #s marker isn't written yet
+  CompiledStore* _compiled; // read-only backend used instead of the dbs if not NULL
+
+  // returns true if dir has a compiled file at least as new as both dbs
+  bool _hasCompiled(const string& dir);
+
+  // opens both dbs; new hash tables are sized for the given # of records, if known
+  void _open(u_int32_t freqRecords = 0, u_int32_t infreqRecords = 0);
+  // writes out buffered records and opens the dbs if needed, so they can be read directly
+  void _ensureOpen();
+  void _openDb(const char* dbPath, Db* db, u_int32_t oFlags, int cache = 5, u_int32_t numRecords = 0);
   void _closeDb(Db* db);
+
+  // writes stem+suffix into buf (at least MAX_TERM_SIZE+1 long); returns false if too long
+  bool _makeKey(const char* stem, const char* suffix, char* buf);
+
+  // writes a record into the db for its frequency, or into the bulk buffer
+  void _put(const char* keyStr, const void* val, u_int32_t size, int frequency, int flags);
+  // writes a record straight into the db for its frequency; the dbs must be open
+  void _putDirect(const char* keyStr, const void* val, u_int32_t size, int frequency, int flags);
+
+  // adds val to the stored keyStr feature, or creates it; the dbs must be open
+  void _addVal(const char* keyStr, double val, int frequency);
+
+  // looks up key in the frequent db and then in the infrequent db; returns non-zero if not found
+  int _get(const char* keyStr, void* val, u_int32_t size);
+
+  // _get for a batch of keys; the value of keys[i] goes to vals + i*size
+  // keys are probed in sorted order, all of them in the frequent db before the misses go to the infrequent one
+  int _getMany(const vector<string>& keys, char* vals, u_int32_t size, vector<bool>* found);
+
+  int _getLegacyTermStats(const char* stem, TermStats* stats);
+
+  // writes the #s key that marks the store as packed, if packed records were put since it was opened
+  void _writePackedMarker();
 };
 
 
@@ -0,0 +1,322 @@
+/*
+ * GammaKernel.cpp
+ *
+ *  Created on: Mar 18, 2014
+ *      Author: yubink
+ */
+
+#include "GammaKernel.h"
+#include <math.h>
+#include <float.h>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define GAMMA_KERNEL_AVX2 1
+#endif
+
+using namespace std;
+
+// Q(a, x) is computed as in Numerical Recipes: by the series for P(a, x) when x < a+1 and
+// by the continued fraction for Q(a, x) otherwise; both are scaled by exp(-x) x^a / Gamma(a)
+static const double FPMIN = DBL_MIN / DBL_EPSILON;
+static const int MAX_ITERATIONS = 100000;
+
+// exp(-x) x^a / Gamma(a)
+static inline double prefactor(double a, double x) {
+  int sign;
+  return exp(-x + a * log(x) - lgamma_r(a, &sign));
+}
+
+// sum of the series for P(a, x), without the prefactor
+static double seriesScalar(double a, double x, double eps) {
+  double ap = a;
+  double del = 1.0 / a;
+  double sum = del;
+  for (int i = 0; i < MAX_ITERATIONS; i++) {
+    ap += 1.0;
+    del *= x / ap;
+    sum += del;
+    if (fabs(del) < fabs(sum) * eps) {
+      break;
+    }
+  }
+  return sum;
+}
+
+// continued fraction for Q(a, x) (modified Lentz), without the prefactor
+static double fractionScalar(double a, double x, double eps) {
+  double b = x + 1.0 - a;
+  double c = 1.0 / FPMIN;
+  double d = 1.0 / b;
+  double h = d;
+  for (int i = 1; i < MAX_ITERATIONS; i++) {
+    double an = -i * (i - a);
+    b += 2.0;
+    d = an * d + b;
+    if (fabs(d) < FPMIN) {
+      d = FPMIN;
+    }
+    c = b + an / c;
+    if (fabs(c) < FPMIN) {
+      c = FPMIN;
+    }
+    d = 1.0 / d;
+    double del = d * c;
+    h *= del;
+    if (fabs(del - 1.0) < eps) {
+      break;
+    }
+  }
+  return h;
+}
+
+#ifdef GAMMA_KERNEL_AVX2
+
+// lanes keep iterating until all four have converged; converged lanes are frozen by mask
+
+__attribute__((target("avx2")))
+static inline __m256d absPd(__m256d v) {
+  return _mm256_andnot_pd(_mm256_set1_pd(-0.0), v);
+}
+
+__attribute__((target("avx2")))
+static void seriesAvx2(const double* a, const double* x, double* out, size_t n, double tolerance) {
+  const __m256d one = _mm256_set1_pd(1.0);
+  const __m256d eps = _mm256_set1_pd(tolerance);
+
+  for (size_t i = 0; i + 4 <= n; i += 4) {
+    __m256d vx = _mm256_loadu_pd(x + i);
+    __m256d ap = _mm256_loadu_pd(a + i);
+    __m256d del = _mm256_div_pd(one, ap);
+    __m256d sum = del;
+    __m256d active = _mm256_castsi256_pd(_mm256_set1_epi64x(-1));
+
+    for (int it = 0; it < MAX_ITERATIONS; it++) {
+      ap = _mm256_add_pd(ap, one);
+      del = _mm256_mul_pd(del, _mm256_div_pd(vx, ap));
+      __m256d next = _mm256_add_pd(sum, del);
+      sum = _mm256_blendv_pd(sum, next, active);
+
+      __m256d converged = _mm256_cmp_pd(absPd(del), _mm256_mul_pd(absPd(sum), eps), _CMP_LT_OQ);
+      active = _mm256_andnot_pd(converged, active);
+      if (_mm256_movemask_pd(active) == 0) {
+        break;
+      }
+    }
+    _mm256_storeu_pd(out + i, sum);
+  }
+}
+
+__attribute__((target("avx2")))
+static void fractionAvx2(const double* a, const double* x, double* out, size_t n, double tolerance) {
+  const __m256d one = _mm256_set1_pd(1.0);
+  const __m256d two = _mm256_set1_pd(2.0);
+  const __m256d eps = _mm256_set1_pd(tolerance);
+  const __m256d fpmin = _mm256_set1_pd(FPMIN);
+
+  for (size_t i = 0; i + 4 <= n; i += 4) {
+    __m256d va = _mm256_loadu_pd(a + i);
+    __m256d b = _mm256_sub_pd(_mm256_add_pd(_mm256_loadu_pd(x + i), one), va);
+    __m256d c = _mm256_set1_pd(1.0 / FPMIN);
+    __m256d d = _mm256_div_pd(one, b);
+    __m256d h = d;
+    __m256d active = _mm256_castsi256_pd(_mm256_set1_epi64x(-1));
+
+    for (int it = 1; it < MAX_ITERATIONS; it++) {
+      __m256d vi = _mm256_set1_pd((double) it);
+      __m256d an = _mm256_mul_pd(_mm256_sub_pd(_mm256_setzero_pd(), vi), _mm256_sub_pd(vi, va));
+      b = _mm256_add_pd(b, two);
+
+      d = _mm256_add_pd(_mm256_mul_pd(an, d), b);
+      d = _mm256_blendv_pd(d, fpmin, _mm256_cmp_pd(absPd(d), fpmin, _CMP_LT_OQ));
+      c = _mm256_add_pd(b, _mm256_div_pd(an, c));
+      c = _mm256_blendv_pd(c, fpmin, _mm256_cmp_pd(absPd(c), fpmin, _CMP_LT_OQ));
+      d = _mm256_div_pd(one, d);
+
+      __m256d del = _mm256_mul_pd(d, c);
+      h = _mm256_blendv_pd(h, _mm256_mul_pd(h, del), active);
+
+      __m256d converged = _mm256_cmp_pd(absPd(_mm256_sub_pd(del, one)), eps, _CMP_LT_OQ);
+      active = _mm256_andnot_pd(converged, active);
+      if (_mm256_movemask_pd(active) == 0) {
+        break;
+      }
+    }
+    _mm256_storeu_pd(out + i, h);
+  }
+}
+
+static bool hasAvx2() {
+  static bool avx2 = __builtin_cpu_supports("avx2");
+  return avx2;
+}
+
+#endif
+
+// runs the series or the fraction over SoA arrays; SIMD for whole blocks of four, scalar for the rest
+static void seriesBatch(const double* a, const double* x, double* out, size_t n, double eps) {
+  size_t done = 0;
+#ifdef GAMMA_KERNEL_AVX2
+  if (hasAvx2() && n >= 4) {
+    seriesAvx2(a, x, out, n, eps);
+    done = n - n % 4;
+  }
+#endif
+  for (size_t i = done; i < n; i++) {
+    out[i] = seriesScalar(a[i], x[i], eps);
+  }
+}
+
+static void fractionBatch(const double* a, const double* x, double* out, size_t n, double eps) {
+  size_t done = 0;
+#ifdef GAMMA_KERNEL_AVX2
+  if (hasAvx2() && n >= 4) {
+    fractionAvx2(a, x, out, n, eps);
+    done = n - n % 4;
+  }
+#endif
+  for (size_t i = done; i < n; i++) {
+    out[i] = fractionScalar(a[i], x[i], eps);
+  }
+}
+
+bool upperGammaQSimd() {
+#ifdef GAMMA_KERNEL_AVX2
+  return hasAvx2();
+#else
+  return false;
+#endif
+}
+
+void upperGammaQ(const double* k, const double* theta, double s_c, double* out, size_t n, double eps,
+    double* work) {
+  vector<double> ownWork;
+  if (work == NULL) {
+    ownWork.resize(GAMMA_WORK_SIZE * n + 1);
+    work = &ownWork[0];
+  }
+  double* a = work;
+  double* x = work + n;
+  double* r = work + 2 * n;
+
+  // split the elements by method so each SIMD lane does the same work; series elements are
+  // packed from the front of a/x and fraction elements from the back
+  size_t numSeries = 0;
+  size_t fractionStart = n;
+  for (size_t i = 0; i < n; i++) {
+    double xi = s_c / theta[i];
+    if (xi <= 0) {
+      out[i] = 1.0;
+    } else if (xi < k[i] + 1.0) {
+      a[numSeries] = k[i];
+      x[numSeries] = xi;
+      numSeries++;
+    } else {
+      fractionStart--;
+      a[fractionStart] = k[i];
+      x[fractionStart] = xi;
+    }
+  }
+
+  seriesBatch(a, x, r, numSeries, eps);
+  fractionBatch(a + fractionStart, x + fractionStart, r + fractionStart, n - fractionStart, eps);
+
+  // walk the elements in the same order to put the results back
+  size_t s = 0;
+  size_t f = n;
+  for (size_t i = 0; i < n; i++) {
+    double xi = s_c / theta[i];
+    if (xi <= 0) {
+      continue;
+    } else if (xi < k[i] + 1.0) {
+      double p = r[s] * prefactor(a[s], x[s]);
+      out[i] = (p >= 1.0) ? 0.0 : 1.0 - p;
+      s++;
+    } else {
+      f--;
+      double q = r[f] * prefactor(a[f], x[f]);
+      out[i] = (q >= 1.0) ? 1.0 : q;
+    }
+  }
+}
+
+// Q(a, x) for a single element
+static double upperQ(double a, double x, double eps) {
+  if (x <= 0) {
+    return 1.0;
+  } else if (x < a + 1.0) {
+    double p = seriesScalar(a, x, eps) * prefactor(a, x);
+    return (p >= 1.0) ? 0.0 : 1.0 - p;
+  }
+  double q = fractionScalar(a, x, eps) * prefactor(a, x);
+  return (q >= 1.0) ? 1.0 : q;
+}
+
+// inverse of the standard normal cdf; Acklam's rational approximation (relative error < 1.2e-9)
+static double normalQuantile(double p) {
+  static const double a[] = { -3.969683028665376e+01, 2.209460984245205e+02, -2.759285104469687e+02,
+      1.383577518672690e+02, -3.066479806614716e+01, 2.506628277459239e+00 };
+  static const double b[] = { -5.447609879822406e+01, 1.615858368580409e+02, -1.556989798598866e+02,
+      6.680131188771972e+01, -1.328068155288572e+01 };
+  static const double c[] = { -7.784894002430293e-03, -3.223964580411365e-01, -2.400758277161838e+00,
+      -2.549732539343734e+00, 4.374664141464968e+00, 2.938163982698783e+00 };
+  static const double d[] = { 7.784695709041462e-03, 3.224671290700398e-01, 2.445134137142996e+00,
+      3.754408661907416e+00 };
+
+  if (p < 0.02425) {
+    double q = sqrt(-2 * log(p));
+    return (((((c[0]*q + c[1])*q + c[2])*q + c[3])*q + c[4])*q + c[5]) / ((((d[0]*q + d[1])*q + d[2])*q + d[3])*q + 1);
+  } else if (p > 1 - 0.02425) {
+    double q = sqrt(-2 * log(1 - p));
+    return -(((((c[0]*q + c[1])*q + c[2])*q + c[3])*q + c[4])*q + c[5]) / ((((d[0]*q + d[1])*q + d[2])*q + d[3])*q + 1);
+  }
+  double q = p - 0.5;
+  double r = q * q;
+  return (((((a[0]*r + a[1])*r + a[2])*r + a[3])*r + a[4])*r + a[5])*q
+      / (((((b[0]*r + b[1])*r + b[2])*r + b[3])*r + b[4])*r + 1);
+}
+
+double upperGammaQuantile(double k, double theta, double p, double eps) {
+  if (p >= 1.0) {
+    return 0.0;
+  } else if (p <= 0.0) {
+    return HUGE_VAL;
+  }
+
+  // Wilson-Hilferty: (X/k)^(1/3) is roughly normal; works in units of theta
+  double z = normalQuantile(1.0 - p);
+  double v = 1.0 / (9.0 * k);
+  double cube = 1.0 - v + z * sqrt(v);
+  double x;
+  if (cube > 0 && k >= 1.0) {
+    x = k * cube * cube * cube;
+  } else {
+    // small shapes: for small x, P(k, x) ~ x^k / Gamma(k+1)
+    int sign;
+    x = exp((log(1.0 - p) + lgamma_r(k + 1.0, &sign)) / k);
+  }
+
+  // Newton steps on Q(k, x) - p; the derivative of Q is -exp(-x) x^(k-1) / Gamma(k)
+  double inner = eps * 0.1;
+  for (int i = 0; i < 100; i++) {
+    double f = upperQ(k, x, inner) - p;
+    double df = -prefactor(k, x) / x;
+    if (df == 0) {
+      break;
+    }
+
+    double step = f / df;
+    double next = x - step;
+    if (next <= 0) {
+      // stay inside the domain
+      next = x / 2;
+    }
+    bool done = fabs(next - x) < eps * next;
+    x = next;
+    if (done) {
+      break;
+    }
+  }
+  return x * theta;
+}
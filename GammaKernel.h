@@ -0,0 +1,45 @@
+/*
+ * GammaKernel.h
+ *
+ * Batched upper tail of the gamma distribution for ranking many shards at once.
+ * The per-element iterations run four lanes at a time with AVX2 when the CPU has
+ * it, and one at a time otherwise.
+ *
+ *  Created on: Mar 18, 2014
+ *      Author: yubink
+ */
+
+#ifndef GAMMAKERNEL_H_
+#define GAMMAKERNEL_H_
+
+#include <stddef.h>
+
+// convergence tolerance that makes results as exact as boost's
+const double GAMMA_EXACT_EPS = 1e-15;
+
+// doubles of scratch space upperGammaQ needs per element
+const size_t GAMMA_WORK_SIZE = 3;
+
+// bound on the error of upperGammaQ at GAMMA_EXACT_EPS against boost::math::gamma_q, for k from
+// 0.05 to 20,000; relative to the exact result, or to 1e-300 for smaller results
+// 'Taily checkgamma' checks it
+const double GAMMA_EXACT_MAX_ERROR = 1e-9;
+const double GAMMA_MAX_CHECKED_K = 20000;
+
+// out[i] = P(X > s_c) for X ~ Gamma(k[i], theta[i]), i.e. the regularized upper incomplete
+// gamma function Q(k[i], s_c/theta[i]); same as
+// boost::math::cdf(complement(boost::math::gamma_distribution<>(k[i], theta[i]), s_c))
+// k and theta must be positive; a larger eps stops the iterations earlier, at about that relative error
+// work is scratch space for GAMMA_WORK_SIZE*n doubles; if it is NULL, the scratch is allocated per call
+void upperGammaQ(const double* k, const double* theta, double s_c, double* out, size_t n,
+    double eps = GAMMA_EXACT_EPS, double* work = NULL);
+
+// true if upperGammaQ runs blocks of four elements with AVX2 on this CPU
+bool upperGammaQSimd();
+
+// s such that P(X > s) = p for X ~ Gamma(k, theta), to a relative error of about eps; the fast
+// counterpart of boost::math::quantile(complement(boost::math::gamma_distribution<>(k, theta), p))
+// starts from the Wilson-Hilferty approximation and refines it with Newton steps
+double upperGammaQuantile(double k, double theta, double p, double eps);
+
+#endif /* GAMMAKERNEL_H_ */
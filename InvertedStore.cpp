@@ -0,0 +1,175 @@
+/*
+ * InvertedStore.cpp
+ *
+ *  Created on: Mar 4, 2014
+ *      Author: yubink
+ */
+
+#include "InvertedStore.h"
+#include <db_cxx.h>
+#include <iostream>
+#include <sys/stat.h>
+
+using namespace std;
+
+const char* InvertedStore::FILE_NAME = "inverted.db";
+const char* InvertedStore::SHARD_NAMES_KEY = "#n";
+const char* InvertedStore::SHARD_STAMPS_KEY = "#v";
+
+InvertedStore::InvertedStore(string dir, bool readOnly, int cache, DbEnv* env) : _db(env, 0) {
+  string path = dir + "/" + FILE_NAME;
+  u_int32_t flags = readOnly ? DB_RDONLY | DB_THREAD : DB_CREATE;
+
+  try {
+    if (env == NULL) {
+      int gigs = cache/1024;
+      cache -= gigs*1024;
+      _db.set_cachesize(gigs, cache*1024*1024, 0);
+    }
+    _db.open(NULL, path.c_str(), NULL, DB_HASH, flags, 0);
+  } catch (DbException &e) {
+    cerr << "Error opening DB. Exiting." << path << endl << e.what() << endl;
+    exit(EXIT_FAILURE);
+  } catch (std::exception &e) {
+    cerr << "Error opening DB. Exiting." << path << endl << e.what() << endl;
+    exit(EXIT_FAILURE);
+  }
+}
+
+InvertedStore::~InvertedStore() {
+  try {
+    _db.close(0);
+  } catch (DbException &e) {
+    cerr << "Error while closing DB. Exiting." << endl << e.what() << endl;
+  } catch (std::exception &e) {
+    cerr << "Error while closing DB. Exiting." << endl << e.what() << endl;
+  }
+}
+
+void InvertedStore::putShardStats(const char* stem, const vector<ShardTermStats>& stats) {
+  if (stats.empty()) {
+    return;
+  }
+  _put(stem, &stats[0], stats.size() * sizeof(ShardTermStats));
+}
+
+void InvertedStore::appendShardStats(const char* stem, const vector<ShardTermStats>& stats) {
+  vector<ShardTermStats> merged;
+  _get(stem, &merged);
+  merged.insert(merged.end(), stats.begin(), stats.end());
+  putShardStats(stem, merged);
+}
+
+int InvertedStore::getShardStats(const char* stem, vector<ShardTermStats>* stats) {
+  return _get(stem, stats);
+}
+
+void InvertedStore::putShardSizes(const vector<double>& sizes) {
+  _put(FeatureStore::SIZE_FEAT_SUFFIX, &sizes[0], sizes.size() * sizeof(double));
+}
+
+int InvertedStore::getShardSizes(vector<double>* sizes) {
+  return _get(FeatureStore::SIZE_FEAT_SUFFIX, sizes);
+}
+
+void InvertedStore::putShardNames(const vector<string>& names) {
+  // newline separated, so names may contain any other character
+  string joined;
+  vector<string>::const_iterator it;
+  for (it = names.begin(); it != names.end(); ++it) {
+    joined.append(*it);
+    joined.push_back('\n');
+  }
+  _put(SHARD_NAMES_KEY, joined.data(), joined.size());
+}
+
+int InvertedStore::getShardNames(vector<string>* names) {
+  names->clear();
+
+  vector<char> joined;
+  if (_get(SHARD_NAMES_KEY, &joined) != 0) {
+    return 1;
+  }
+
+  string name;
+  for (size_t i = 0; i < joined.size(); i++) {
+    if (joined[i] == '\n') {
+      names->push_back(name);
+      name.clear();
+    } else {
+      name.push_back(joined[i]);
+    }
+  }
+  return 0;
+}
+
+void InvertedStore::putShardStamps(const vector<int64_t>& stamps) {
+  if (stamps.empty()) {
+    return;
+  }
+  _put(SHARD_STAMPS_KEY, &stamps[0], stamps.size() * sizeof(int64_t));
+}
+
+int InvertedStore::getShardStamps(vector<int64_t>* stamps) {
+  return _get(SHARD_STAMPS_KEY, stamps);
+}
+
+void InvertedStore::appendShardStamps(const string& dir, vector<int64_t>* stamps) {
+  const char* files[] = { "/freq.db", "/infreq.db" };
+  for (int i = 0; i < 2; i++) {
+    struct stat st;
+    if (stat((dir + files[i]).c_str(), &st) != 0) {
+      stamps->push_back(0);
+    } else {
+      stamps->push_back((int64_t) st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec);
+    }
+  }
+}
+
+void InvertedStore::_put(const char* keyStr, const void* val, u_int32_t size) {
+  Dbt key((void*) keyStr, strlen(keyStr) + 1);
+  Dbt data((void*) val, size);
+
+  int ret = _db.put(NULL, &key, &data, 0);
+  if (ret != 0) {
+    _db.err(ret, "Put failed for key %s", keyStr);
+  }
+}
+
+template<class T>
+int InvertedStore::_get(const char* keyStr, vector<T>* out) {
+  Dbt key((void*) keyStr, strlen(keyStr) + 1);
+
+  // start with whatever capacity the caller's vector already has
+  if (out->empty()) {
+    out->resize(out->capacity() > 0 ? out->capacity() : 16);
+  } else {
+    out->resize(out->capacity());
+  }
+
+  while (true) {
+    Dbt data;
+    data.set_data(&(*out)[0]);
+    data.set_ulen(out->size() * sizeof(T));
+    data.set_flags(DB_DBT_USERMEM);
+
+    int ret;
+    try {
+      ret = _db.get(NULL, &key, &data, 0);
+    } catch (DbMemoryException &e) {
+      ret = DB_BUFFER_SMALL;
+    }
+
+    if (ret == DB_BUFFER_SMALL) {
+      // data.get_size() holds the size the record needs
+      out->resize(data.get_size() / sizeof(T));
+      continue;
+    } else if (ret != 0) {
+      out->clear();
+      return 1;
+    }
+
+    out->resize(data.get_size() / sizeof(T));
+    return 0;
+  }
+}
@@ -0,0 +1,73 @@
+/*
+ * InvertedStore.h
+ *
+ * Term-major copy of the shard statistics: for every stem, one record listing the
+ * stats of only those shards that contain the stem, sorted by shard id.
+ *
+ *  Created on: Mar 4, 2014
+ *      Author: yubink
+ */
+
+#ifndef INVERTEDSTORE_H_
+#define INVERTEDSTORE_H_
+
+#include "FeatureStore.h"
+#include <stdint.h>
+#include <vector>
+
+using namespace std;
+
+// statistics of one stem in one shard
+struct ShardTermStats {
+  uint shard; // shard id; position of the shard in the db list, starting at 1
+  FeatureStore::TermStats stats;
+};
+
+class InvertedStore {
+
+private:
+  Db _db;
+
+public:
+  static const char* FILE_NAME;
+  static const char* SHARD_NAMES_KEY;
+  static const char* SHARD_STAMPS_KEY;
+
+  // cache size is in megabytes; if env is given, the db shares its cache instead (see FeatureStore::openEnv)
+  InvertedStore(string dir, bool readOnly = false, int cache = 1, DbEnv* env = NULL);
+  virtual ~InvertedStore();
+
+  // stores the shard list of stem; stats must be sorted by shard id
+  void putShardStats(const char* stem, const vector<ShardTermStats>& stats);
+
+  // appends to the shard list of stem; appended shard ids must be larger than the stored ones
+  void appendShardStats(const char* stem, const vector<ShardTermStats>& stats);
+
+  // returns the shard list of stem in stats; if stem isn't found, returns non-zero and stats is empty
+  int getShardStats(const char* stem, vector<ShardTermStats>* stats);
+
+  // shard sizes (# of docs); sizes[0] is the corpus size, sizes[i] the size of shard i
+  void putShardSizes(const vector<double>& sizes);
+  int getShardSizes(vector<double>* sizes);
+
+  // names of the shards in shard id order; used to check the store matches a db list
+  void putShardNames(const vector<string>& names);
+  int getShardNames(vector<string>* names);
+
+  // modification times of the shard dbs when the store was built, two per shard in shard id
+  // order (see appendShardStamps); used to tell a shard db was rebuilt since
+  void putShardStamps(const vector<int64_t>& stamps);
+  int getShardStamps(vector<int64_t>* stamps);
+
+  // appends the modification times of dir's freq.db and infreq.db, in nanoseconds; 0 if missing
+  static void appendShardStamps(const string& dir, vector<int64_t>* stamps);
+
+private:
+  void _put(const char* keyStr, const void* val, u_int32_t size);
+
+  // reads a variable length record into out, growing it as needed; returns non-zero if not found
+  template<class T>
+  int _get(const char* keyStr, vector<T>* out);
+};
+
+#endif /* INVERTEDSTORE_H_ */
@@ -1,16 +1,19 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <unistd.h>
 #include <iostream>
 #include <algorithm>
 #include <string>
 #include <vector>
 #include <set>
+#include <deque>
 #include <db_cxx.h>
 #include <boost/math/distributions/gamma.hpp>
 #include <boost/algorithm/string.hpp>
 #include <boost/algorithm/string/split.hpp>
 #include <boost/algorithm/string/classification.hpp>
 #include <boost/unordered_map.hpp>
+#include "boost/filesystem.hpp"
 
 #include "indri/QueryEnvironment.hpp"
 #include "indri/Repository.hpp"
@@ -18,57 +21,21 @@
 #include "indri/ScopedLock.hpp"
 
 #include "FeatureStore.h"
+#include "GammaKernel.h"
+#include "InvertedStore.h"
+#include "Params.h"
+#include "RankServer.h"
 #include "ShardRanker.h"
+#include "StemCache.h"
+#include "TermNormalizer.h"
 
 using namespace indri::index;
 using namespace indri::collection;
 
-char* getOption(char ** begin, char ** end, const std::string & option) {
-  char ** itr = std::find(begin, end, option);
-  if (itr != end && ++itr != end) {
-    return *itr;
-  }
-  return 0;
-}
-
-bool hasOption(char** begin, char** end, const std::string& option) {
-  return std::find(begin, end, option) != end;
-}
-
-void readParams(const char* paramFile, map<string, string> *params) {
-  ifstream file;
-  file.open(paramFile);
-
-  string line;
-  if (file.is_open()) {
-
-    while (getline(file, line)) {
-      char mutableLine[line.size() + 1];
-      std::strcpy(mutableLine, line.c_str());
-
-      char* key = std::strtok(mutableLine, "=");
-      char* value = std::strtok(NULL, "=");
-      (*params)[key] = value;
-    }
-    file.close();
-  }
-}
-
-
 double calcIndriFeature(double tf, double ctf, double totalTermCount, double docLength, int mu = 2500) {
   return log( (tf + mu*(ctf/totalTermCount)) / (docLength + mu) );
 }
 
-void tokenize(string line, const char * delim, vector<string>* output) {
-  char mutableLine[line.size() + 1];
-  std::strcpy(mutableLine, line.c_str());
-  for (char* value = std::strtok(mutableLine, delim); 
-      value != NULL; 
-      value = std::strtok(NULL, delim)) {
-    output->push_back(value);
-  }
-}
-
 struct shard_data {
   double min;
   double shardDf;
@@ -78,27 +45,22 @@ struct shard_data {
   shard_data(): min(DBL_MAX), shardDf(0.0), f(0.0), f2(0.0) {};
 };
 
+void printStemCounts(StemCache& stems, ostream& out) {
+  out << "Stem cache: " << stems.hits() << " hits (" << stems.stopwordHits() << " stopwords), "
+      << stems.misses() << " misses" << endl;
+}
+
 void storeTermStats(FeatureStore* store, string term, int ctf, double min,
     double shardDf, double f, double f2) {
-  // store min feature for term (for this shard; will later be merged into corpus-wide Db)
-  string minFeatKey(term);
-  minFeatKey.append(FeatureStore::MIN_FEAT_SUFFIX);
-  store->putFeature((char*)minFeatKey.c_str(), min, ctf);
-
-  // get and store shard df feature for term
-  string dfFeatKey(term);
-  dfFeatKey.append(FeatureStore::SIZE_FEAT_SUFFIX);
-  store->putFeature((char*)dfFeatKey.c_str(), shardDf, ctf);
-
-  // store sum f
-  string featKey(term);
-  featKey.append(FeatureStore::FEAT_SUFFIX);
-  store->putFeature((char*) featKey.c_str(), f, ctf);
-
-  // store sum f^2
-  string squaredFeatKey(term);
-  squaredFeatKey.append(FeatureStore::SQUARED_FEAT_SUFFIX);
-  store->putFeature((char*) squaredFeatKey.c_str(), f2, ctf);
+  // min feature is for this shard; will later be merged into corpus-wide Db
+  FeatureStore::TermStats stats;
+  stats.min = min;
+  stats.df = shardDf;
+  stats.f = f;
+  stats.f2 = f2;
+
+  // store all term stats as one packed record
+  store->putTermStats(term.c_str(), stats, ctf);
 }
 
 // innards of buildshard
@@ -139,8 +101,16 @@ void collectShardStats(DocListIterator* docIter, TermData* termData, FeatureStor
 }
 
 // innards of buildcorpus
+struct corpus_data {
+  double df;
+  double ctf;
+
+  corpus_data(): df(0.0), ctf(0.0) {};
+};
+
+// innards of buildcorpus; sums are kept in memory until writeCorpusStats
 void collectCorpusStats(DocListIterator* docIter, TermData* termData,
-    FeatureStore* store) {
+    boost::unordered_map<string, corpus_data>* termStats) {
   double ctf = termData->corpus.totalCount;
   double df = termData->corpus.documentCount;
 
@@ -150,15 +120,35 @@ void collectCorpusStats(DocListIterator* docIter, TermData* termData,
     docIter->nextEntry();
   }
 
-  // store df feature for term
-  string dfFeatKey(termData->term);
-  dfFeatKey.append(FeatureStore::SIZE_FEAT_SUFFIX);
-  store->addValFeature((char*) dfFeatKey.c_str(), df, (int) ctf);
+  // add to the term's sums over all indexes
+  corpus_data& data = (*termStats)[termData->term];
+  data.df += df;
+  data.ctf += ctf;
+}
 
-  // store ctf feature for term
-  string ctfFeatKey(termData->term);
-  ctfFeatKey.append(FeatureStore::TERM_SIZE_FEAT_SUFFIX);
-  store->addValFeature((char*) ctfFeatKey.c_str(), ctf, (int) ctf);
+// writes the df and ctf features of the summed terms and empties termStats;
+// if the store already holds sums from an earlier batch, the new sums are added to them
+// (a term is put in the db for its ctf in the first batch it's in; see rerouteCorpusStats)
+void writeCorpusStats(boost::unordered_map<string, corpus_data>* termStats, FeatureStore* store,
+    bool addToStored) {
+  boost::unordered_map<string, corpus_data>::iterator it;
+  for (it = termStats->begin(); it != termStats->end(); ++it) {
+    string dfFeatKey(it->first);
+    dfFeatKey.append(FeatureStore::SIZE_FEAT_SUFFIX);
+    string ctfFeatKey(it->first);
+    ctfFeatKey.append(FeatureStore::TERM_SIZE_FEAT_SUFFIX);
+
+    double df = it->second.df;
+    double ctf = it->second.ctf;
+    if (addToStored) {
+      store->addValFeature((char*) dfFeatKey.c_str(), df, (int) ctf);
+      store->addValFeature((char*) ctfFeatKey.c_str(), ctf, (int) ctf);
+    } else {
+      store->putFeature((char*) dfFeatKey.c_str(), df, (int) ctf);
+      store->putFeature((char*) ctfFeatKey.c_str(), ctf, (int) ctf);
+    }
+  }
+  termStats->clear();
 }
 
 void buildFromMap(std::map<string, string>& params) {
@@ -224,8 +214,17 @@ void buildFromMap(std::map<string, string>& params) {
       exit(EXIT_FAILURE);
     }
 
-    // create feature store for shard
-    FeatureStore* store = new FeatureStore(dbPath+"/"+shardIdStr, false, ram/mapFiles.size());
+    // create feature store for shard; half of its share of ram buffers records for a bulk load
+    // a buffer of 0 would turn bulk loading off, so each half gets at least 1MB
+    int storeRam = ram/mapFiles.size();
+    if (storeRam < 2) {
+      if (it == mapFiles.begin()) {
+        cerr << "ram=" << ram << " is less than 2MB per shard; using 2MB per shard." << endl;
+      }
+      storeRam = 2;
+    }
+    FeatureStore* store = new FeatureStore(dbPath+"/"+shardIdStr, false, storeRam/2);
+    store->startBulkLoad(storeRam/2);
     stores.push_back(store);
 
     // grab shard id and create reverse mapping between doc -> shard
@@ -272,6 +271,7 @@ void buildFromMap(std::map<string, string>& params) {
 //      &totalTermCount);
 
   // only create shard statistics for specified terms
+  StemCache stemCache(indexes[0]);
   set<string> stemsSeen;
   int termCnt = 0;
   for (it = terms.begin(); it != terms.end(); ++it) {
@@ -282,7 +282,7 @@ void buildFromMap(std::map<string, string>& params) {
     }
 
     // stemify term
-    string stem = (indexes[0])->processTerm(*it);
+    string stem = stemCache.stem(*it);
     if (stemsSeen.find(stem) != stemsSeen.end()) {
       continue;
     }
@@ -383,6 +383,7 @@ void buildFromMap(std::map<string, string>& params) {
     }
 
   } // end term iter
+  printStemCounts(stemCache, cout);
 
   // clean up
   vector<FeatureStore*>::iterator fit;
@@ -420,8 +421,9 @@ void buildShard(std::map<string, string>& params) {
   // open corpus statistics db
   FeatureStore corpusStats(corpusDbPath, true);
 
-  // create and open the data store
-  FeatureStore store(dbPath, false, ram);
+  // create and open the data store; half of the ram buffers records for a bulk load
+  FeatureStore store(dbPath, false, ram/2);
+  store.startBulkLoad(ram/2);
 
   indri::collection::Repository repo;
   repo.openRead(indexPath);
@@ -475,6 +477,7 @@ void buildShard(std::map<string, string>& params) {
 
     } else {
       // only create shard statistics for specified terms
+      StemCache stemCache(&repo);
       set<string> stemsSeen;
       vector<string>::iterator it;
       int termCnt = 0;
@@ -484,7 +487,7 @@ void buildShard(std::map<string, string>& params) {
           cout << "  Finished " << termCnt << " terms" << endl;
         }
         // stemify term
-        string stem = repo.processTerm(*it);
+        string stem = stemCache.stem(*it);
         if (stemsSeen.find(stem) != stemsSeen.end()) {
           continue;
         }
@@ -503,12 +506,56 @@ void buildShard(std::map<string, string>& params) {
         collectShardStats(docIter, termData, &corpusStats, &store,
             index, totalTermCount);
       }
+      printStemCounts(stemCache, cout);
 
     }
 
   }
 }
 
+// terms to check an exported normalizer config on: the whitelist if there is one, otherwise an
+// even sample of count terms of repo's vocabulary, each also in upper case; the vocabulary holds
+// stems, so a whitelist of raw query terms is the stronger check
+void normalizerCheckTerms(Repository* repo, const vector<string>& whitelist, long count,
+    vector<string>* terms) {
+  if (!whitelist.empty()) {
+    *terms = whitelist;
+    return;
+  }
+
+  Repository::index_state state = repo->indexes();
+  Index* index = (*state)[0];
+  long uniqueTerms = (long) index->uniqueTermCount();
+  count = min(count, uniqueTerms);
+  for (long i = 0; i < count; i++) {
+    // term ids start at 1
+    string term = index->term(1 + (int) (i * uniqueTerms / count));
+    terms->push_back(term);
+    terms->push_back(boost::to_upper_copy(term));
+  }
+}
+
+// runs terms through both the config exported to dir and repo's own term processing; prints
+// the first few that come out differently and returns how many do
+long checkNormalizer(Repository* repo, const string& dir, const vector<string>& terms) {
+  TermNormalizer normalizer(dir);
+  long mismatches = 0;
+  vector<string>::const_iterator it;
+  for (it = terms.begin(); it != terms.end(); ++it) {
+    string exported = normalizer.process(*it);
+    string indexed = repo->processTerm(*it);
+    if (exported != indexed) {
+      if (mismatches < 10) {
+        cerr << "Term '" << *it << "': normalizer config gives '" << exported << "', index gives '"
+            << indexed << "'" << endl;
+      }
+      mismatches++;
+    }
+  }
+  cout << "Checked normalizer config on " << terms.size() << " terms: " << mismatches << " differ." << endl;
+  return mismatches;
+}
+
 void buildCorpus(std::map<string, string>& params) {
   using namespace indri::collection;
   using namespace indri::index;
@@ -526,7 +573,15 @@ void buildCorpus(std::map<string, string>& params) {
     tokenize(params["terms"], ":", &terms);
   }
 
-  FeatureStore store(dbPath, false, ram);
+  // df/ctf are summed over all indexes in memory and written to the store in one go, or in a few
+  // batches if the sums outgrow half of the ram; the rest goes to the db cache and the write buffer
+  FeatureStore store(dbPath, false, ram/4);
+  store.startBulkLoad(ram/4);
+
+  boost::unordered_map<string, corpus_data> termStats;
+  size_t maxTerms = (size_t) ram * 1024 * 1024 / 2 / 96; // ~96 bytes per term for the node, stem and sums
+  bool written = false;
+
   vector<Repository*> indexes;
 
   char mutableLine[indexstr.size() + 1];
@@ -541,6 +596,19 @@ void buildCorpus(std::map<string, string>& params) {
     indexes.push_back(repo);
   }
 
+  // the term list is stemmed once for all indexes; they are built with the same stemmer and stopwords
+  StemCache stemCache(indexes[0]);
+
+  // so rankers can stem queries the same way without opening an index; rankers will need an
+  // index instead if the config doesn't stem like it
+  TermNormalizer::exportConfig(indexes[0], dbPath);
+  vector<string> checkTerms;
+  normalizerCheckTerms(indexes[0], terms, 10000, &checkTerms);
+  if (checkNormalizer(indexes[0], dbPath, checkTerms) > 0) {
+    boost::filesystem::remove(boost::filesystem::path(dbPath) / TermNormalizer::FILE_NAME);
+    cerr << "Exported normalizer config doesn't match the index; removed it." << endl;
+  }
+
   // go through all indexes and collect ctf and df statistics.
   long totalTermCount = 0;
   long totalDocCount = 0;
@@ -579,8 +647,13 @@ void buildCorpus(std::map<string, string>& params) {
         TermData* termData = entry->termData;
         entry->iterator->startIteration();
 
-        collectCorpusStats(entry->iterator, termData, &store);
+        collectCorpusStats(entry->iterator, termData, &termStats);
         iter->nextEntry();
+
+        if (termStats.size() >= maxTerms) {
+          writeCorpusStats(&termStats, &store, written);
+          written = true;
+        }
       }
       delete iter;
 
@@ -597,7 +670,7 @@ void buildCorpus(std::map<string, string>& params) {
           cout << "  Finished " << termCnt << " terms" << endl;
         }
         // stemify term; make sure we're not doing this again!
-        string stem = (*it)->processTerm(*tit);
+        string stem = stemCache.stem(*tit);
         if (stemsSeen.find(stem) != stemsSeen.end()) {
           continue;
         }
@@ -613,12 +686,22 @@ void buildCorpus(std::map<string, string>& params) {
 
         docIter->startIteration();
         TermData* termData = docIter->termData();
-        collectCorpusStats(docIter, termData, &store);
+        collectCorpusStats(docIter, termData, &termStats);
         delete docIter;
       }
     }
   }
 
+  writeCorpusStats(&termStats, &store, written);
+  if (written) {
+    // batches only knew their own ctf; move the terms whose total puts them in the other db
+    long moved = store.rerouteCorpusStats();
+    cout << "Moved " << moved << " terms to the db for their total ctf" << endl;
+  }
+  if (terms.size() > 0) {
+    printStemCounts(stemCache, cout);
+  }
+
   // add collection global features needed for shard ranking
   string totalTermKey(FeatureStore::TERM_SIZE_FEAT_SUFFIX);
   store.putFeature((char*)totalTermKey.c_str(), totalTermCount, FeatureStore::FREQUENT_TERMS+1);
@@ -641,39 +724,54 @@ void mergeMin(std::map<string, string>& params) {
     stores.push_back(new FeatureStore(dbs[i], true));
   }
 
+  // terms are handled in batches so that each shard store is probed once per batch
+  const uint batchSize = 10000;
+  vector<string> stems;
+  vector<double> ctfs;
+  vector<FeatureStore::TermStats> stats;
+  vector<bool> found;
+
   int termCnt = 0;
   // iterate through the database for all terms and find gloabl min feature
   FeatureStore::TermIterator* termit = corpusStore.getTermIterator();
-  while (!termit->finished()) {
-    termCnt++;
-    if(termCnt % 100000 == 0) {
-      cout << "  Finished " << termCnt << " terms" << endl;
+  while (!termit->finished() || !stems.empty()) {
+    if (!termit->finished() && stems.size() < batchSize) {
+      // get a stem and its ctf
+      pair<string,double> termAndCtf = termit->currrentEntry();
+      stems.push_back(termAndCtf.first);
+      ctfs.push_back(termAndCtf.second);
+      termit->nextTerm();
+      continue;
     }
 
-    // get a stem and its ctf
-    pair<string,double> termAndCtf = termit->currrentEntry();
-    string stem = termAndCtf.first;
-    double ctf = termAndCtf.second;
-
     // keep track of min feature
-    double globalMin = DBL_MAX;
-    string minFeatKey(stem);
-    minFeatKey.append(FeatureStore::MIN_FEAT_SUFFIX);
+    vector<double> globalMins(stems.size(), DBL_MAX);
 
-    // for each shard, grab the share min feature from its stats db and find global min
+    // for each shard, grab the share min features from its stats db and find global mins
     vector<FeatureStore*>::iterator it;
     for (it = stores.begin(); it != stores.end(); ++it) {
-      double currMin;
-      (*it)->getFeature((char*)minFeatKey.c_str(), &currMin);
-      if (currMin < globalMin) {
-        globalMin = currMin;
+      (*it)->getTermStats(stems, &stats, &found);
+      for (uint j = 0; j < stems.size(); j++) {
+        if (found[j] && stats[j].min < globalMins[j]) {
+          globalMins[j] = stats[j].min;
+        }
       }
     }
 
-    // store min feature for term
-    corpusStore.putFeature((char*)minFeatKey.c_str(), globalMin, (int)ctf);
+    for (uint j = 0; j < stems.size(); j++) {
+      termCnt++;
+      if(termCnt % 100000 == 0) {
+        cout << "  Finished " << termCnt << " terms" << endl;
+      }
+
+      // store min feature for term
+      string minFeatKey(stems[j]);
+      minFeatKey.append(FeatureStore::MIN_FEAT_SUFFIX);
+      corpusStore.putFeature((char*)minFeatKey.c_str(), globalMins[j], (int)ctfs[j]);
+    }
 
-    termit->nextTerm();
+    stems.clear();
+    ctfs.clear();
   }
   delete termit;
 
@@ -683,51 +781,787 @@ void mergeMin(std::map<string, string>& params) {
   }
 }
 
+// converts shard dbs built with separate #d/#f/#f2/#m keys into packed term stats records
+void pack(std::map<string, string>& params) {
+  string dbstr = params["db"];
+
+  int ram = 2000;
+  if (params.find("ram") != params.end()) {
+    ram = atoi(params["ram"].c_str());
+  }
+
+  // get list of shard statistic dbs
+  vector<string> dbs;
+  tokenize(dbstr, ":", &dbs);
+
+  vector<string>::iterator it;
+  for (it = dbs.begin(); it != dbs.end(); ++it) {
+    cout << "Packing " << (*it) << endl;
+    FeatureStore store(*it, false, ram);
+    long termCnt = store.packTermStats();
+    cout << "  Packed " << termCnt << " terms total" << endl;
+  }
+}
+
+// converts freq.db/infreq.db pairs into immutable compiled files for fast read-only use
+void compile(std::map<string, string>& params) {
+  string dbstr = params["db"];
+
+  // get list of statistic dbs
+  vector<string> dbs;
+  tokenize(dbstr, ":", &dbs);
+
+  vector<string>::iterator it;
+  for (it = dbs.begin(); it != dbs.end(); ++it) {
+    cout << "Compiling " << (*it) << endl;
+    string compiledPath = (*it) + "/" + CompiledStore::FILE_NAME;
+    string tmpPath = compiledPath + ".tmp";
+
+    // drop the old compiled file so the store below reads the dbs;
+    // processes that still have it mapped keep their copy
+    unlink(compiledPath.c_str());
+
+    FeatureStore store(*it, true);
+    if (!store.compile(tmpPath) || rename(tmpPath.c_str(), compiledPath.c_str()) != 0) {
+      cerr << "Error writing compiled stats " << compiledPath << endl;
+      exit(EXIT_FAILURE);
+    }
+  }
+}
+
+// writes the stem lists collected so far to the inverted store
+void flushShardLists(boost::unordered_map<string, vector<ShardTermStats> >& lists,
+    InvertedStore* inverted, bool append) {
+  boost::unordered_map<string, vector<ShardTermStats> >::iterator it;
+  for (it = lists.begin(); it != lists.end(); ++it) {
+    if (append) {
+      inverted->appendShardStats(it->first.c_str(), it->second);
+    } else {
+      inverted->putShardStats(it->first.c_str(), it->second);
+    }
+  }
+  lists.clear();
+}
+
+// builds the term-major inverted store from packed shard dbs; it is written to the corpus db dir
+void invert(std::map<string, string>& params) {
+  string dbstr = params["db"];
+
+  int ram = 2000;
+  if (params.find("ram") != params.end()) {
+    ram = atoi(params["ram"].c_str());
+  }
+
+  // get list of shard statistic dbs; first one is the corpus db
+  vector<string> dbs;
+  tokenize(dbstr, ":", &dbs);
+
+  InvertedStore inverted(dbs[0], false, ram/2);
+
+  // shard sizes and names; the ranker checks the names against its own db list
+  vector<double> sizes;
+  vector<string> names;
+  vector<int64_t> stamps;
+  string sizeKey(FeatureStore::SIZE_FEAT_SUFFIX);
+
+  double corpusSize = 0;
+  FeatureStore corpusStore(dbs[0], true);
+  corpusStore.getFeature((char*) sizeKey.c_str(), &corpusSize);
+  sizes.push_back(corpusSize);
+
+  // per stem shard lists are kept in RAM until they hit half the ram limit,
+  // then appended to the store; shards go in id order so lists stay sorted
+  size_t maxBuffered = (size_t) ram * 1024 * 1024 / 2 / (2 * sizeof(ShardTermStats));
+  size_t buffered = 0;
+  bool spilled = false;
+  boost::unordered_map<string, vector<ShardTermStats> > lists;
+
+  for (uint i = 1; i < dbs.size(); i++) {
+    cout << "Inverting " << dbs[i] << endl;
+    FeatureStore store(dbs[i], true);
+    if (!store.isPacked()) {
+      cerr << "Shard db " << dbs[i] << " isn't packed; run Taily pack on it first." << endl;
+      exit(EXIT_FAILURE);
+    }
+
+    double shardSize = 0;
+    store.getFeature((char*) sizeKey.c_str(), &shardSize);
+    sizes.push_back(shardSize);
+    names.push_back(boost::filesystem::path(dbs[i]).filename().string());
+    InvertedStore::appendShardStamps(dbs[i], &stamps);
+
+    ShardTermStats entry;
+    entry.shard = i;
+
+    FeatureStore::TermIterator* termit = store.getTermStatsIterator();
+    while (!termit->finished()) {
+      entry.stats = termit->currentTermStats();
+      if (entry.stats.df > 0) {
+        lists[termit->currrentEntry().first].push_back(entry);
+        buffered++;
+      }
+      termit->nextTerm();
+    }
+    delete termit;
+
+    if (buffered > maxBuffered) {
+      flushShardLists(lists, &inverted, spilled);
+      spilled = true;
+      buffered = 0;
+    }
+  }
+  flushShardLists(lists, &inverted, spilled);
+
+  inverted.putShardSizes(sizes);
+  inverted.putShardNames(names);
+  inverted.putShardStamps(stamps);
+}
+
+// exports the stemmer and stopwords of an index to a corpus db built before buildcorpus did so
+void exportNormalizer(std::map<string, string>& params) {
+  using namespace indri::collection;
+
+  // first db is the corpus db
+  vector<string> dbs;
+  tokenize(params["db"], ":", &dbs);
+
+  vector<string> whitelist;
+  if (params.find("terms") != params.end()) {
+    tokenize(params["terms"], ":", &whitelist);
+  }
+  long checkTerms = 10000;
+  if (params.find("checkTerms") != params.end()) {
+    checkTerms = atol(params["checkTerms"].c_str());
+  }
+
+  Repository repo;
+  repo.openRead(params["index"]);
+  TermNormalizer::exportConfig(&repo, dbs[0]);
+
+  // a config that stems differently from the index would silently make rankers miss stems
+  vector<string> terms;
+  normalizerCheckTerms(&repo, whitelist, checkTerms, &terms);
+  if (checkNormalizer(&repo, dbs[0], terms) > 0) {
+    boost::filesystem::remove(boost::filesystem::path(dbs[0]) / TermNormalizer::FILE_NAME);
+    cerr << "Exported normalizer config doesn't match the index; removed it." << endl;
+    exit(EXIT_FAILURE);
+  }
+  repo.close();
+}
+
+// splits a qnum:query line the way strtok(line, ":") twice would, without copying the line
+void parseQueryLine(const string& line, string* qnum, string* query) {
+  size_t begin = line.find_first_not_of(':');
+  size_t colon = line.find(':', begin);
+  qnum->assign(line, min(begin, line.size()), colon == string::npos ? string::npos : colon - begin);
+
+  begin = line.find_first_not_of(':', colon);
+  query->clear();
+  if (colon != string::npos && begin != string::npos) {
+    size_t end = line.find(':', begin);
+    query->assign(line, begin, end == string::npos ? string::npos : end - begin);
+  }
+}
+
+// reads a query file of qnum:query lines; returns false if it can't be opened
+bool readQueries(char* queryFile, vector<string>* qnums, vector<string>* queries) {
+  ifstream qfile;
+  qfile.open(queryFile);
+  if (!qfile.is_open()) {
+    return false;
+  }
+
+  string line, qnum, query;
+  while (getline(qfile, line)) {
+    parseQueryLine(line, &qnum, &query);
+    qnums->push_back(qnum);
+    queries->push_back(query);
+  }
+  qfile.close();
+  return true;
+}
+
+// output formats of Taily run
+enum RunFormat {
+  RUN_TEXT,   // qnum<tab>query, then a shardId<tab>score line per shard, then a blank line
+  RUN_TSV,    // a qnum<tab>shardId<tab>score line per shard
+  RUN_BINARY  // see appendRanking
+};
+
+// appends one query's ranking to out in the given format
+void appendRanking(RunFormat format, ShardRanker& ranker, const string& qnum, const string& query,
+    const vector<ShardScore>& ranking, string* out) {
+  char score[32];
+
+  if (format == RUN_BINARY) {
+    // native byte order: uint32 qnum length, qnum, uint32 # of shards, then per shard its uint32
+    // index in the db list and its double score
+    uint32_t length = qnum.size();
+    out->append((const char*) &length, sizeof(length));
+    out->append(qnum);
+    uint32_t count = ranking.size();
+    out->append((const char*) &count, sizeof(count));
+    for (size_t i = 0; i < ranking.size(); i++) {
+      uint32_t shard = ranking[i].shard;
+      out->append((const char*) &shard, sizeof(shard));
+      out->append((const char*) &ranking[i].score, sizeof(double));
+    }
+    return;
+  }
+
+  if (format == RUN_TEXT) {
+    out->append(qnum);
+    out->push_back('\t');
+    out->append(query);
+    out->push_back('\n');
+  }
+  for (size_t i = 0; i < ranking.size(); i++) {
+    if (format == RUN_TSV) {
+      out->append(qnum);
+      out->push_back('\t');
+    }
+    out->append(ranker.shardName(ranking[i].shard));
+    // same digits as ostream's default
+    snprintf(score, sizeof(score), "\t%g\n", ranking[i].score);
+    out->append(score);
+  }
+  if (format == RUN_TEXT) {
+    out->push_back('\n');
+  }
+}
+
+// query stream of the query file, or stdin if there is none or it is "-"; qfile is opened for the
+// former; exits if the file can't be opened
+istream* openQueries(char* queryFile, ifstream* qfile) {
+  if (queryFile == NULL || strcmp(queryFile, "-") == 0) {
+    return &cin;
+  }
+  qfile->open(queryFile);
+  if (!qfile->is_open()) {
+    cerr << "Couldn't open query file " << queryFile << ". Exiting." << endl;
+    exit(EXIT_FAILURE);
+  }
+  return qfile;
+}
+
 void run(std::map<string, string>& params, char* queryFile) {
   using namespace indri::collection;
 
   string dbstr = params["db"];
-  string index = params["index"];
   int n_c = atoi(params["n_c"].c_str());
 
+  int ram = ShardRanker::DEFAULT_CACHE;
+  if (params.find("ram") != params.end()) {
+    ram = atoi(params["ram"].c_str());
+  }
+
   // get list of shard statistic dbs
   vector<string> dbs;
   tokenize(dbstr, ":", &dbs);
 
-  // get indri index
+  // get indri index; without one, terms are stemmed with the normalizer config in the corpus db
   Repository repo;
-  repo.openRead(index);
+  Repository* repoPtr = NULL;
+  if (params.find("index") != params.end()) {
+    repo.openRead(params["index"]);
+    repoPtr = &repo;
+  }
 
   // initialize Taily ranker
-  ShardRanker ranker(dbs, &repo, n_c);
+  ShardRanker ranker(dbs, repoPtr, n_c, ram);
+  if (params.find("preload") != params.end()) {
+    ranker.init(atoi(params["preload"].c_str()));
+  }
+  if (params.find("fastError") != params.end()) {
+    ranker.setFastMode(atof(params["fastError"].c_str()));
+  }
 
-  // get query file
+  // list shards without any query term too (with a score of 0)
+  bool allShards = (params.find("allShards") != params.end() && params["allShards"] == "true");
+
+  RunFormat format = RUN_TEXT;
+  if (params.find("format") != params.end()) {
+    if (params["format"] == "tsv") {
+      format = RUN_TSV;
+    } else if (params["format"] == "binary") {
+      format = RUN_BINARY;
+    } else if (params["format"] != "text") {
+      cerr << "Unknown format " << params["format"] << ". Exiting." << endl;
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  // from a query file, queries are ranked in batches, so stems shared between queries are only
+  // looked up once, but from stdin each query is answered as soon as it is read, so Taily can sit
+  // in a pipeline
   ifstream qfile;
-  qfile.open(queryFile);
+  istream* in = openQueries(queryFile, &qfile);
+  size_t batchSize = (in == &qfile) ? 1000 : 1;
+  if (params.find("batch") != params.end()) {
+    batchSize = max(atoi(params["batch"].c_str()), 1);
+  }
 
-  string line;
-  if (qfile.is_open()) {
+  // rankings are written through one large buffer and flushed once per query
+  static char outBuffer[1 << 20];
+  setvbuf(stdout, outBuffer, _IOFBF, sizeof(outBuffer));
+
+  vector<string> qnums;
+  vector<string> queries;
+  vector<vector<ShardScore> > rankings;
+  string line, qnum, query, out;
+  bool more = true;
+  while (more) {
+    qnums.clear();
+    queries.clear();
+    while (queries.size() < batchSize) {
+      if (!getline(*in, line)) {
+        more = false;
+        break;
+      }
+      parseQueryLine(line, &qnum, &query);
+      qnums.push_back(qnum);
+      queries.push_back(query);
+    }
+    if (queries.empty()) {
+      break;
+    }
+
+    ranker.rankBatch(queries, &rankings, allShards);
+
+    for (uint q = 0; q < queries.size(); q++) {
+      out.clear();
+      appendRanking(format, ranker, qnums[q], queries[q], rankings[q], &out);
+      if (fwrite(out.data(), 1, out.size(), stdout) != out.size() || fflush(stdout) != 0) {
+        // nobody is reading any more
+        exit(EXIT_FAILURE);
+      }
+    }
+  }
+
+  // the rankings go to stdout
+  printStemCounts(ranker.stemCache(), cerr);
+}
+
+// ranks every query for each of a list of n_c values and prints the shards selected for each of a
+// list of v values; stems, stats and the shards' gamma parameters are only computed once per query
+void sweep(std::map<string, string>& params, char* queryFile) {
+  using namespace indri::collection;
+
+  string dbstr = params["db"];
+
+  int ram = ShardRanker::DEFAULT_CACHE;
+  if (params.find("ram") != params.end()) {
+    ram = atoi(params["ram"].c_str());
+  }
 
-    while (getline(qfile, line)) {
-      char mutableLine[line.size() + 1];
-      std::strcpy(mutableLine, line.c_str());
+  vector<string> values;
+  vector<uint> n_cs;
+  tokenize(params["n_c"], ":", &values);
+  for (size_t i = 0; i < values.size(); i++) {
+    n_cs.push_back(atoi(values[i].c_str()));
+  }
+
+  values.clear();
+  vector<double> vs;
+  tokenize(params["v"], ":", &values);
+  for (size_t i = 0; i < values.size(); i++) {
+    vs.push_back(atof(values[i].c_str()));
+  }
+
+  if (n_cs.empty() || vs.empty()) {
+    cerr << "Taily sweep needs a list of n_c and of v values. Exiting." << endl;
+    exit(EXIT_FAILURE);
+  }
+
+  // full rankings are long; by default only the selections are printed
+  bool printRankings = (params.find("rankings") != params.end() && params["rankings"] == "true");
+
+  vector<string> dbs;
+  tokenize(dbstr, ":", &dbs);
+
+  Repository repo;
+  Repository* repoPtr = NULL;
+  if (params.find("index") != params.end()) {
+    repo.openRead(params["index"]);
+    repoPtr = &repo;
+  }
+
+  // the ranker's own n_c isn't used; every ranking gets its n_c from the list
+  ShardRanker ranker(dbs, repoPtr, n_cs[0], ram);
+  if (params.find("preload") != params.end()) {
+    ranker.init(atoi(params["preload"].c_str()));
+  }
+  if (params.find("fastError") != params.end()) {
+    ranker.setFastMode(atof(params["fastError"].c_str()));
+  }
 
-      char* qnum = std::strtok(mutableLine, ":");
-      char* query = std::strtok(NULL, ":");
+  static char outBuffer[1 << 20];
+  setvbuf(stdout, outBuffer, _IOFBF, sizeof(outBuffer));
 
-      vector<pair<string, double> > ranking;
-      if (query) {
-        ranker.rank(query, &ranking);
+  ifstream qfile;
+  istream* in = openQueries(queryFile, &qfile);
+
+  vector<vector<ShardScore> > rankings;
+  vector<ShardScore> selected;
+  string line, qnum, query, out;
+  char number[64];
+  while (getline(*in, line)) {
+    parseQueryLine(line, &qnum, &query);
+    ranker.rankSweep(query, n_cs, &rankings);
+
+    out.clear();
+    for (size_t c = 0; c < n_cs.size(); c++) {
+      vector<ShardScore>& ranking = rankings[c];
+
+      // R<tab>qnum<tab>n_c<tab>shardId<tab>score per shard
+      for (size_t i = 0; printRankings && i < ranking.size(); i++) {
+        snprintf(number, sizeof(number), "\t%u\t", n_cs[c]);
+        out.append("R\t");
+        out.append(qnum);
+        out.append(number);
+        out.append(ranker.shardName(ranking[i].shard));
+        snprintf(number, sizeof(number), "\t%g\n", ranking[i].score);
+        out.append(number);
       }
 
-      cout << qnum << "\t" << query << endl;
-      for(int i = 0; i < ranking.size(); i++) {
-        cout << ranking[i].first << "\t" << ranking[i].second << endl;
+      // S<tab>qnum<tab>n_c<tab>v<tab># of shards<tab>shardIds scoring more than v, best first,
+      // separated by ','
+      for (size_t j = 0; j < vs.size(); j++) {
+        selected.clear();
+        for (size_t i = 0; i < ranking.size(); i++) {
+          if (ranking[i].score > vs[j]) {
+            selected.push_back(ranking[i]);
+          }
+        }
+        stable_sort(selected.begin(), selected.end(), shardScoreSort);
+
+        out.append("S\t");
+        out.append(qnum);
+        snprintf(number, sizeof(number), "\t%u\t%g\t%u\t", n_cs[c], vs[j], (uint) selected.size());
+        out.append(number);
+        for (size_t i = 0; i < selected.size(); i++) {
+          if (i > 0) {
+            out.push_back(',');
+          }
+          out.append(ranker.shardName(selected[i].shard));
+        }
+        out.push_back('\n');
       }
-      cout << endl;
     }
-    qfile.close();
+
+    if (fwrite(out.data(), 1, out.size(), stdout) != out.size() || fflush(stdout) != 0) {
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  printStemCounts(ranker.stemCache(), cerr);
+}
+
+// keeps a ranker open and answers ranking requests from other processes (see RankServer.h)
+void serve(std::map<string, string>& params) {
+  using namespace indri::collection;
+
+  string dbstr = params["db"];
+  int n_c = atoi(params["n_c"].c_str());
+
+  int ram = ShardRanker::DEFAULT_CACHE;
+  if (params.find("ram") != params.end()) {
+    ram = atoi(params["ram"].c_str());
+  }
+
+  if (params.find("socket") == params.end() && params.find("port") == params.end()) {
+    cerr << "Taily serve needs a socket path or a port. Exiting." << endl;
+    exit(EXIT_FAILURE);
+  }
+
+  vector<string> dbs;
+  tokenize(dbstr, ":", &dbs);
+
+  Repository repo;
+  Repository* repoPtr = NULL;
+  if (params.find("index") != params.end()) {
+    repo.openRead(params["index"]);
+    repoPtr = &repo;
+  }
+
+  ShardRanker ranker(dbs, repoPtr, n_c, ram);
+  if (params.find("preload") != params.end()) {
+    ranker.init(atoi(params["preload"].c_str()));
+  } else {
+    ranker.init();
+  }
+  if (params.find("fastError") != params.end()) {
+    ranker.setFastMode(atof(params["fastError"].c_str()));
+  }
+  if (params.find("rankCache") != params.end()) {
+    ranker.setRankingCache(atoi(params["rankCache"].c_str()));
+  }
+
+  RankServer server(&ranker);
+  if (params.find("v") != params.end()) {
+    uint maxShards = 0;
+    if (params.find("maxShards") != params.end()) {
+      maxShards = atoi(params["maxShards"].c_str());
+    }
+    server.setSelection(atof(params["v"].c_str()), maxShards);
+  }
+  server.setAllShards(params.find("allShards") != params.end() && params["allShards"] == "true");
+
+  if (params.find("socket") != params.end()) {
+    server.listenUnix(params["socket"]);
+  } else {
+    server.listenTcp(atoi(params["port"].c_str()));
   }
+  server.serve();
+}
+
+// sends the queries of a query file (or stdin) to a Taily serve, keeping up to pipeline of them
+// in flight, and prints the responses in Taily run's text format; with the same parameters as the
+// server, the output is the same as Taily run's, so diffing the two checks the responses arrive
+// in request order
+void queryServer(std::map<string, string>& params, char* queryFile) {
+  if (params.find("socket") == params.end() && params.find("port") == params.end()) {
+    cerr << "Taily query needs a socket path or a port. Exiting." << endl;
+    exit(EXIT_FAILURE);
+  }
+
+  size_t pipeline = 64;
+  if (params.find("pipeline") != params.end()) {
+    pipeline = max(1, atoi(params["pipeline"].c_str()));
+  }
+
+  RankClient client;
+  if (params.find("socket") != params.end()) {
+    client.connectUnix(params["socket"]);
+  } else {
+    client.connectTcp(atoi(params["port"].c_str()));
+  }
+
+  ifstream qfile;
+  istream* in = openQueries(queryFile, &qfile);
+
+  // queries sent but not answered yet, oldest first
+  deque<pair<string, string> > pending;
+  string line, qnum, query, response;
+  bool more = true;
+  while (more || !pending.empty()) {
+    if (more && pending.size() < pipeline) {
+      if (!getline(*in, line)) {
+        more = false;
+        continue;
+      }
+      parseQueryLine(line, &qnum, &query);
+      if (!client.send(query)) {
+        cerr << "Server closed the connection. Exiting." << endl;
+        exit(EXIT_FAILURE);
+      }
+      pending.push_back(make_pair(qnum, query));
+
+      // a pipe is answered at once, as Taily run does
+      if (in != &cin) {
+        continue;
+      }
+    }
+
+    if (!client.receive(&response)) {
+      cerr << "Server closed the connection. Exiting." << endl;
+      exit(EXIT_FAILURE);
+    }
+    cout << pending.front().first << "\t" << pending.front().second << "\n" << response << "\n";
+    if (in == &cin) {
+      cout.flush();
+    }
+    pending.pop_front();
+  }
+}
+
+// largest difference between the scores of a ranking and the exact ones, by shard id; relative
+// for scores of 1 (document) or more and absolute below that, so exact scores of 0 count too
+double scoreError(const vector<double>& exactScores, const vector<ShardScore>& ranking) {
+  double maxError = 0.0;
+  for (uint i = 0; i < ranking.size(); i++) {
+    double e = exactScores[ranking[i].shard];
+    double f = ranking[i].score;
+    if (e != f) {
+      maxError = max(maxError, fabs(f - e) / max(fabs(e), 1.0));
+    }
+  }
+  return maxError;
+}
+
+// ranks every query both exactly and in fast mode and reports where the two disagree: the largest
+// relative difference in a shard's score, and whether the shards selected by v (score > v) or
+// their order differ; exits with failure if any selection differs
+void compare(std::map<string, string>& params, char* queryFile) {
+  using namespace indri::collection;
+
+  string dbstr = params["db"];
+  int n_c = atoi(params["n_c"].c_str());
+
+  int ram = ShardRanker::DEFAULT_CACHE;
+  if (params.find("ram") != params.end()) {
+    ram = atoi(params["ram"].c_str());
+  }
+
+  double fastError = 1e-6;
+  if (params.find("fastError") != params.end()) {
+    fastError = atof(params["fastError"].c_str());
+  }
+
+  double v = 45.0;
+  if (params.find("v") != params.end()) {
+    v = atof(params["v"].c_str());
+  }
+
+  vector<string> dbs;
+  tokenize(dbstr, ":", &dbs);
+
+  Repository repo;
+  Repository* repoPtr = NULL;
+  if (params.find("index") != params.end()) {
+    repo.openRead(params["index"]);
+    repoPtr = &repo;
+  }
+
+  ShardRanker ranker(dbs, repoPtr, n_c, ram);
+  if (params.find("preload") != params.end()) {
+    ranker.init(atoi(params["preload"].c_str()));
+  }
+
+  vector<string> qnums;
+  vector<string> queries;
+  if (!readQueries(queryFile, &qnums, &queries)) {
+    cerr << "Couldn't open query file" << endl;
+    exit(EXIT_FAILURE);
+  }
+
+  // the reference is boost's gamma distribution, as before the batched kernel
+  vector<vector<ShardScore> > exact;
+  ranker.setBoostMode(true);
+  ranker.rankBatch(queries, &exact);
+  ranker.setBoostMode(false);
+
+  vector<vector<ShardScore> > kernel;
+  ranker.rankBatch(queries, &kernel);
+
+  vector<vector<ShardScore> > fast;
+  ranker.setFastMode(fastError);
+  ranker.rankBatch(queries, &fast);
+
+  double worstError = 0.0;
+  double worstKernelError = 0.0;
+  uint setDiffs = 0;
+  uint orderDiffs = 0;
+  for (uint q = 0; q < queries.size(); q++) {
+    vector<double> exactScores(ranker.numShards() + 1, 0.0);
+    for (uint i = 0; i < exact[q].size(); i++) {
+      exactScores[exact[q][i].shard] = exact[q][i].score;
+    }
+    double maxError = scoreError(exactScores, fast[q]);
+    worstError = max(worstError, maxError);
+    worstKernelError = max(worstKernelError, scoreError(exactScores, kernel[q]));
+
+    // shards selected by v, in ranking order
+    vector<uint> exactSelected, fastSelected;
+    for (uint i = 0; i < exact[q].size() && exact[q][i].score > v; i++) {
+      exactSelected.push_back(exact[q][i].shard);
+    }
+    for (uint i = 0; i < fast[q].size() && fast[q][i].score > v; i++) {
+      fastSelected.push_back(fast[q][i].shard);
+    }
+
+    bool sameOrder = (exactSelected == fastSelected);
+    sort(exactSelected.begin(), exactSelected.end());
+    sort(fastSelected.begin(), fastSelected.end());
+    bool sameSet = (exactSelected == fastSelected) && exact[q].size() == fast[q].size();
+
+    if (!sameSet) {
+      setDiffs++;
+    } else if (!sameOrder) {
+      orderDiffs++;
+    }
+
+    cout << qnums[q] << "\t" << maxError << "\t" << (sameSet ? "same" : "DIFFERENT") << "\t"
+        << (sameOrder ? "same" : "DIFFERENT") << endl;
+  }
+
+  cout << "queries: " << queries.size() << " max error: " << worstError << " selection differs: "
+      << setDiffs << " order differs: " << orderDiffs << " exact kernel max error: " << worstKernelError << endl;
+
+  if (setDiffs > 0) {
+    exit(EXIT_FAILURE);
+  }
+}
+
+// checks the gamma tail kernel against boost::math::gamma_q on random points; the series and
+// the continued fraction get points of their own and some close to where the two meet, and
+// every point is evaluated in a batch (in a SIMD block or a scalar tail) and on its own
+void checkGamma(std::map<string, string>& params) {
+  long points = 200000;
+  if (params.find("points") != params.end()) {
+    points = atol(params["points"].c_str());
+  }
+  srand48(params.find("seed") != params.end() ? atol(params["seed"].c_str()) : 1);
+
+  long numSeries = 0;
+  long numFraction = 0;
+  long numTail = 0;
+  double worstError = 0.0;
+  double worstK = 0.0;
+  double worstX = 0.0;
+
+  vector<double> k, theta, batched;
+  double single;
+  for (long done = 0, batch = 0; done < points; batch++) {
+    // batch sizes cycle through every remainder mod 4, so blocks end in 0 to 3 scalar elements
+    size_t n = min((long) (1000 + batch % 4), points - done);
+    double s_c = 0.5 + 10 * drand48();
+    k.resize(n);
+    theta.resize(n);
+    batched.resize(n);
+    for (size_t i = 0; i < n; i++) {
+      k[i] = exp(log(0.05) + (log(GAMMA_MAX_CHECKED_K) - log(0.05)) * drand48());
+      double x;
+      if (i % 8 == 0) {
+        x = (k[i] + 1.0) * (1.0 + 1e-3 * (2 * drand48() - 1));
+      } else {
+        x = k[i] * exp(8 * drand48() - 4);
+      }
+      theta[i] = s_c / x;
+    }
+    upperGammaQ(&k[0], &theta[0], s_c, &batched[0], n);
+
+    for (size_t i = 0; i < n; i++) {
+      double x = s_c / theta[i];
+      double exact = boost::math::gamma_q(k[i], x);
+      upperGammaQ(&k[i], &theta[i], s_c, &single, 1);
+
+      double error = max(fabs(batched[i] - exact), fabs(single - exact)) / max(exact, 1e-300);
+      if (error > worstError) {
+        worstError = error;
+        worstK = k[i];
+        worstX = x;
+      }
+      if (x < k[i] + 1.0) {
+        numSeries++;
+      } else {
+        numFraction++;
+      }
+    }
+    numTail += n % 4;
+    done += n;
+  }
+
+  cout << "points: " << points << " series: " << numSeries << " fraction: " << numFraction
+      << " in scalar tails: " << numTail << " SIMD: " << (upperGammaQSimd() ? "AVX2" : "none") << endl;
+  cout << "max error: " << worstError << " (k=" << worstK << " x=" << worstX << ") bound: "
+      << GAMMA_EXACT_MAX_ERROR << endl;
+
+  if (worstError > GAMMA_EXACT_MAX_ERROR) {
+    cout << "FAILED" << endl;
+    exit(EXIT_FAILURE);
+  }
+  cout << "OK" << endl;
 }
 
 void buildFromDV(std::map<string, string>& params) {
@@ -904,7 +1738,9 @@ int main(int argc, char * argv[]) {
 
   // read parameter file
   std::map<string, string> params;
-  readParams(paramFile, &params);
+  if (paramFile != NULL) {
+    readParams(paramFile, &params);
+  }
 
   if (strcmp(argv[1], "buildfrommap") == 0) {
     buildFromMap(params);
@@ -922,8 +1758,34 @@ int main(int argc, char * argv[]) {
   } else if (strcmp(argv[1], "mergemin") == 0) {
     mergeMin(params);
 
+  } else if (strcmp(argv[1], "pack") == 0) {
+    pack(params);
+
+  } else if (strcmp(argv[1], "compile") == 0) {
+    compile(params);
+
+  } else if (strcmp(argv[1], "invert") == 0) {
+    invert(params);
+
+  } else if (strcmp(argv[1], "normalizer") == 0) {
+    exportNormalizer(params);
+
   } else if (strcmp(argv[1], "run") == 0) {
     run(params, getOption(argv, argv + argc, "-q"));
+  } else if (strcmp(argv[1], "compare") == 0) {
+    compare(params, getOption(argv, argv + argc, "-q"));
+
+  } else if (strcmp(argv[1], "sweep") == 0) {
+    sweep(params, getOption(argv, argv + argc, "-q"));
+
+  } else if (strcmp(argv[1], "serve") == 0) {
+    serve(params);
+
+  } else if (strcmp(argv[1], "query") == 0) {
+    queryServer(params, getOption(argv, argv + argc, "-q"));
+
+  } else if (strcmp(argv[1], "checkgamma") == 0) {
+    checkGamma(params);
 
   } else {
     std::cout << "Unrecognized option." << std::endl;
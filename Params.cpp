@@ -0,0 +1,55 @@
+/*
+ * Params.cpp
+ *
+ *  Created on: Mar 28, 2014
+ *      Author: yubink
+ */
+
+#include "Params.h"
+#include <cstring>
+#include <algorithm>
+#include <fstream>
+
+char* getOption(char ** begin, char ** end, const std::string & option) {
+  char ** itr = std::find(begin, end, option);
+  if (itr != end && ++itr != end) {
+    return *itr;
+  }
+  return 0;
+}
+
+bool hasOption(char** begin, char** end, const std::string& option) {
+  return std::find(begin, end, option) != end;
+}
+
+void readParams(const char* paramFile, map<string, string> *params) {
+  ifstream file;
+  file.open(paramFile);
+
+  string line;
+  if (file.is_open()) {
+
+    while (getline(file, line)) {
+      vector<char> mutableLine(line.begin(), line.end());
+      mutableLine.push_back('\0');
+
+      char* key = std::strtok(&mutableLine[0], "=");
+      char* value = std::strtok(NULL, "=");
+      if (key == NULL) {
+        continue;
+      }
+      (*params)[key] = (value == NULL) ? "" : value;
+    }
+    file.close();
+  }
+}
+
+void tokenize(string line, const char * delim, vector<string>* output) {
+  vector<char> mutableLine(line.begin(), line.end());
+  mutableLine.push_back('\0');
+  for (char* value = std::strtok(&mutableLine[0], delim);
+      value != NULL;
+      value = std::strtok(NULL, delim)) {
+    output->push_back(value);
+  }
+}
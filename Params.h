@@ -0,0 +1,31 @@
+/*
+ * Params.h
+ *
+ * Command line and parameter file helpers shared by Taily and TailyBench.
+ *
+ *  Created on: Mar 28, 2014
+ *      Author: yubink
+ */
+
+#ifndef PARAMS_H_
+#define PARAMS_H_
+
+#include <map>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// the argument following option, or NULL if option isn't given
+char* getOption(char ** begin, char ** end, const std::string & option);
+
+bool hasOption(char** begin, char** end, const std::string& option);
+
+// reads key=value lines into params; lines without a key are skipped, and a key without a value
+// gets an empty one
+void readParams(const char* paramFile, map<string, string> *params);
+
+// appends the non-empty pieces of line between any of the characters in delim to output
+void tokenize(string line, const char * delim, vector<string>* output);
+
+#endif /* PARAMS_H_ */
@@ -0,0 +1,341 @@
+/*
+ * RankServer.cpp
+ *
+ *  Created on: Mar 26, 2014
+ *      Author: yubink
+ */
+
+#include "RankServer.h"
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <iostream>
+
+// bytes read from a client at a time
+static const size_t READ_SIZE = 64 * 1024;
+
+// microseconds to wait before accepting again when out of file descriptors
+static const useconds_t ACCEPT_RETRY_DELAY = 100 * 1000;
+
+struct Connection {
+  RankServer* server;
+  int fd;
+};
+
+static void appendLength(uint32_t length, string* out) {
+  uint32_t be = htonl(length);
+  out->append((const char*) &be, sizeof(be));
+}
+
+// writes all of data; returns false if the client went away
+static bool writeFully(int fd, const char* data, size_t size) {
+  while (size > 0) {
+    ssize_t n = write(fd, data, size);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    } else if (n <= 0) {
+      return false;
+    }
+    data += n;
+    size -= n;
+  }
+  return true;
+}
+
+RankServer::RankServer(ShardRanker* ranker) :
+    _ranker(ranker), _listenFd(-1), _select(false), _v(0.0), _maxShards(0), _allShards(false) {
+  // a client that disconnects mid-response shows up as a failed write, not a signal
+  signal(SIGPIPE, SIG_IGN);
+}
+
+RankServer::~RankServer() {
+  if (_listenFd >= 0) {
+    close(_listenFd);
+  }
+}
+
+void RankServer::setSelection(double v, uint maxShards) {
+  _select = true;
+  _v = v;
+  _maxShards = maxShards;
+}
+
+void RankServer::setAllShards(bool allShards) {
+  _allShards = allShards;
+}
+
+void RankServer::listenUnix(const string& path) {
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (path.size() >= sizeof(addr.sun_path)) {
+    cerr << "Socket path " << path << " is too long. Exiting." << endl;
+    exit(EXIT_FAILURE);
+  }
+  strcpy(addr.sun_path, path.c_str());
+
+  // a socket file left behind by an earlier server; anything else at the path is left alone
+  struct stat st;
+  if (lstat(path.c_str(), &st) == 0) {
+    if (!S_ISSOCK(st.st_mode)) {
+      cerr << "Socket path " << path << " exists and isn't a socket. Exiting." << endl;
+      exit(EXIT_FAILURE);
+    }
+    unlink(path.c_str());
+  }
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0 || bind(fd, (struct sockaddr*) &addr, sizeof(addr)) != 0) {
+    cerr << "Couldn't bind socket " << path << ": " << strerror(errno) << ". Exiting." << endl;
+    exit(EXIT_FAILURE);
+  }
+  _listen(fd, path);
+}
+
+void RankServer::listenTcp(int port) {
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = htons(port);
+
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  int on = 1;
+  if (fd >= 0) {
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+  }
+  if (fd < 0 || bind(fd, (struct sockaddr*) &addr, sizeof(addr)) != 0) {
+    cerr << "Couldn't bind port " << port << ": " << strerror(errno) << ". Exiting." << endl;
+    exit(EXIT_FAILURE);
+  }
+
+  char where[32];
+  snprintf(where, sizeof(where), "127.0.0.1:%d", port);
+  _listen(fd, where);
+}
+
+void RankServer::_listen(int fd, const string& where) {
+  if (listen(fd, SOMAXCONN) != 0) {
+    cerr << "Couldn't listen on " << where << ": " << strerror(errno) << ". Exiting." << endl;
+    exit(EXIT_FAILURE);
+  }
+  if (_listenFd >= 0) {
+    close(_listenFd);
+  }
+  _listenFd = fd;
+  cerr << "Listening on " << where << endl;
+}
+
+void RankServer::serve() {
+  bool outOfFds = false;
+  while (true) {
+    int fd = accept(_listenFd, NULL, NULL);
+    if (fd < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) {
+        continue;
+      } else if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) {
+        // the pending client stays queued; retrying right away would spin until a client
+        // closes its connection, so wait a little between tries
+        if (!outOfFds) {
+          cerr << "Error accepting connections: " << strerror(errno) << "; retrying." << endl;
+          outOfFds = true;
+        }
+        usleep(ACCEPT_RETRY_DELAY);
+        continue;
+      }
+      cerr << "Error accepting connections: " << strerror(errno) << endl;
+      return;
+    }
+    outOfFds = false;
+
+    // responses are small and latency matters more than packet count (fails harmlessly on Unix sockets)
+    int on = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+    Connection* connection = new Connection();
+    connection->server = this;
+    connection->fd = fd;
+
+    pthread_t thread;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&thread, &attr, _connectionThread, connection) != 0) {
+      cerr << "Couldn't start a thread for a client; dropping it." << endl;
+      close(fd);
+      delete connection;
+    }
+    pthread_attr_destroy(&attr);
+  }
+}
+
+void* RankServer::_connectionThread(void* arg) {
+  Connection* connection = (Connection*) arg;
+  connection->server->_handle(connection->fd);
+  close(connection->fd);
+  delete connection;
+  return NULL;
+}
+
+void RankServer::_handle(int fd) {
+  // unanswered bytes from the client; pipelined requests may arrive several per read, so all
+  // complete ones are answered and their responses go out in one write
+  vector<char> in;
+  size_t start = 0;
+  string out;
+  string query;
+  vector<ShardScore> ranking;
+
+  while (true) {
+    size_t filled = in.size();
+    in.resize(filled + READ_SIZE);
+    ssize_t n = read(fd, &in[filled], READ_SIZE);
+    if (n < 0 && errno == EINTR) {
+      in.resize(filled);
+      continue;
+    } else if (n <= 0) {
+      return;
+    }
+    in.resize(filled + n);
+
+    out.clear();
+    while (in.size() - start >= sizeof(uint32_t)) {
+      uint32_t be;
+      memcpy(&be, &in[start], sizeof(be));
+      uint32_t length = ntohl(be);
+      if (length > MAX_REQUEST_SIZE) {
+        cerr << "Request of " << length << " bytes is too long; closing the connection." << endl;
+        return;
+      }
+      if (in.size() - start - sizeof(uint32_t) < length) {
+        break;
+      }
+
+      query.assign(&in[start + sizeof(uint32_t)], length);
+      start += sizeof(uint32_t) + length;
+
+      if (_select) {
+        _ranker->rankTop(query, &ranking, _v, _maxShards);
+      } else {
+        _ranker->rank(query, &ranking, _allShards);
+      }
+      _appendResponse(ranking, &out);
+    }
+
+    // keep the start of an incomplete request
+    in.erase(in.begin(), in.begin() + start);
+    start = 0;
+
+    if (!out.empty() && !writeFully(fd, out.data(), out.size())) {
+      return;
+    }
+  }
+}
+
+void RankServer::_appendResponse(const vector<ShardScore>& ranking, string* out) {
+  size_t lengthAt = out->size();
+  appendLength(0, out);
+
+  char score[32];
+  vector<ShardScore>::const_iterator it;
+  for (it = ranking.begin(); it != ranking.end(); ++it) {
+    out->append(_ranker->shardName(it->shard));
+    out->push_back('\t');
+    snprintf(score, sizeof(score), "%g", it->score);
+    out->append(score);
+    out->push_back('\n');
+  }
+
+  // now that the payload's length is known
+  uint32_t be = htonl(out->size() - lengthAt - sizeof(uint32_t));
+  memcpy(&(*out)[lengthAt], &be, sizeof(be));
+}
+
+RankClient::RankClient() : _fd(-1) {
+  signal(SIGPIPE, SIG_IGN);
+}
+
+RankClient::~RankClient() {
+  if (_fd >= 0) {
+    close(_fd);
+  }
+}
+
+void RankClient::connectUnix(const string& path) {
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (path.size() >= sizeof(addr.sun_path)) {
+    cerr << "Socket path " << path << " is too long. Exiting." << endl;
+    exit(EXIT_FAILURE);
+  }
+  strcpy(addr.sun_path, path.c_str());
+  _connect(socket(AF_UNIX, SOCK_STREAM, 0), (struct sockaddr*) &addr, sizeof(addr), path);
+}
+
+void RankClient::connectTcp(int port) {
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = htons(port);
+
+  char where[32];
+  snprintf(where, sizeof(where), "127.0.0.1:%d", port);
+  _connect(socket(AF_INET, SOCK_STREAM, 0), (struct sockaddr*) &addr, sizeof(addr), where);
+
+  int on = 1;
+  setsockopt(_fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+}
+
+void RankClient::_connect(int fd, struct sockaddr* addr, size_t size, const string& where) {
+  if (fd < 0 || connect(fd, addr, size) != 0) {
+    cerr << "Couldn't connect to " << where << ": " << strerror(errno) << ". Exiting." << endl;
+    exit(EXIT_FAILURE);
+  }
+  _fd = fd;
+}
+
+bool RankClient::send(const string& query) {
+  string frame;
+  appendLength(query.size(), &frame);
+  frame.append(query);
+  return writeFully(_fd, frame.data(), frame.size());
+}
+
+bool RankClient::receive(string* response) {
+  while (true) {
+    if (_in.size() >= sizeof(uint32_t)) {
+      uint32_t be;
+      memcpy(&be, &_in[0], sizeof(be));
+      size_t length = ntohl(be);
+      if (_in.size() - sizeof(uint32_t) >= length) {
+        response->assign(_in.begin() + sizeof(uint32_t), _in.begin() + sizeof(uint32_t) + length);
+        _in.erase(_in.begin(), _in.begin() + sizeof(uint32_t) + length);
+        return true;
+      }
+    }
+
+    size_t filled = _in.size();
+    _in.resize(filled + READ_SIZE);
+    ssize_t n = read(_fd, &_in[filled], READ_SIZE);
+    if (n < 0 && errno == EINTR) {
+      _in.resize(filled);
+      continue;
+    } else if (n <= 0) {
+      _in.resize(filled);
+      return false;
+    }
+    _in.resize(filled + n);
+  }
+}
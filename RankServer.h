@@ -0,0 +1,103 @@
+/*
+ * RankServer.h
+ *
+ * Keeps a ShardRanker resident and answers ranking requests over a Unix domain
+ * socket or a TCP loopback port; see 'Taily serve'.
+ *
+ * Both directions are framed the same way: a 4-byte big-endian payload length
+ * followed by the payload. A request's payload is the query text; the response
+ * payload is the ranking as shardName<tab>score lines, best first (empty if no
+ * shard has a query term). A client may send any number of requests without
+ * waiting; responses come back in request order. Each connection is served by
+ * its own thread, so slow clients don't hold up the others.
+ *
+ *  Created on: Mar 26, 2014
+ *      Author: yubink
+ */
+
+#ifndef RANKSERVER_H_
+#define RANKSERVER_H_
+
+#include "ShardRanker.h"
+#include <stdint.h>
+#include <sys/socket.h>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+class RankServer {
+public:
+  // requests with a longer payload get the connection closed
+  static const uint32_t MAX_REQUEST_SIZE = 1024 * 1024;
+
+private:
+  ShardRanker* _ranker;
+  int _listenFd;
+
+  // rankTop() selection, if _select; otherwise rankings are complete, as rank() returns them
+  bool _select;
+  double _v;
+  uint _maxShards;
+
+  bool _allShards;
+
+public:
+  RankServer(ShardRanker* ranker);
+  virtual ~RankServer();
+
+  // only return the shards rankTop() would select: those scoring more than v, at most maxShards
+  // of them (0 for no limit)
+  void setSelection(double v, uint maxShards);
+
+  // list shards without any query term too, with a score of 0 (ignored with a selection)
+  void setAllShards(bool allShards);
+
+  // listen on a Unix domain socket at path, replacing whatever is there; exits on failure
+  void listenUnix(const string& path);
+
+  // listen on 127.0.0.1:port; exits on failure
+  void listenTcp(int port);
+
+  // accepts clients until the listening socket fails
+  void serve();
+
+private:
+  static void* _connectionThread(void* arg);
+
+  // answers requests on fd until the client closes it or breaks the protocol
+  void _handle(int fd);
+
+  // appends the response frame of ranking to out
+  void _appendResponse(const vector<ShardScore>& ranking, string* out);
+
+  void _listen(int fd, const string& where);
+};
+
+// client side of the same protocol; 'Taily query' uses it to pipeline a query file to a server
+class RankClient {
+private:
+  int _fd;
+
+  // bytes received but not yet returned by receive()
+  vector<char> _in;
+
+public:
+  RankClient();
+  virtual ~RankClient();
+
+  // connect to a server's Unix domain socket or to its port on 127.0.0.1; exit on failure
+  void connectUnix(const string& path);
+  void connectTcp(int port);
+
+  // sends one request; returns false if the server went away
+  bool send(const string& query);
+
+  // waits for the next response, in request order; returns false if the server went away
+  bool receive(string* response);
+
+private:
+  void _connect(int fd, struct sockaddr* addr, size_t size, const string& where);
+};
+
+#endif /* RANKSERVER_H_ */
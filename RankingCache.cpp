@@ -0,0 +1,119 @@
+/*
+ * RankingCache.cpp
+ *
+ *  Created on: Mar 25, 2014
+ *      Author: yubink
+ */
+
+#include "RankingCache.h"
+#include "indri/ScopedLock.hpp"
+#include <stdio.h>
+#include <algorithm>
+#include <boost/functional/hash.hpp>
+
+RankingCache::RankingCache(size_t capacity) {
+  setCapacity(capacity);
+}
+
+void RankingCache::setCapacity(size_t capacity) {
+  _segmentCapacity = (capacity == 0) ? 0 : max(capacity / NUM_SEGMENTS, (size_t) 1);
+  clear();
+}
+
+bool RankingCache::enabled() const {
+  return _segmentCapacity > 0;
+}
+
+string RankingCache::makeKey(vector<string> stems, uint n_c, const string& options) {
+  sort(stems.begin(), stems.end());
+
+  // stems never contain spaces, as queries are split on them
+  char prefix[32];
+  snprintf(prefix, sizeof(prefix), "%u", n_c);
+  string key(prefix);
+  key.push_back(' ');
+  key.append(options);
+
+  vector<string>::iterator it;
+  for (it = stems.begin(); it != stems.end(); ++it) {
+    key.push_back(' ');
+    key.append(*it);
+  }
+  return key;
+}
+
+bool RankingCache::get(const string& key, vector<ShardScore>* ranking, uint64_t* generation) {
+  Segment& segment = _segment(key);
+  indri::thread::ScopedLock lock(segment.lock);
+
+  boost::unordered_map<string, LruList::iterator>::iterator it = segment.index.find(key);
+  if (it == segment.index.end()) {
+    segment.misses++;
+    *generation = segment.generation;
+    return false;
+  }
+
+  // move to the front of the LRU list
+  segment.lru.splice(segment.lru.begin(), segment.lru, it->second);
+  segment.hits++;
+  ranking->assign(it->second->second.begin(), it->second->second.end());
+  return true;
+}
+
+void RankingCache::put(const string& key, const vector<ShardScore>& ranking, uint64_t generation) {
+  Segment& segment = _segment(key);
+  indri::thread::ScopedLock lock(segment.lock);
+
+  // another thread may have put it first, and it's stale if the cache was cleared meanwhile
+  if (generation != segment.generation || segment.index.find(key) != segment.index.end()) {
+    return;
+  }
+
+  segment.lru.push_front(make_pair(key, ranking));
+  segment.index[key] = segment.lru.begin();
+
+  if (segment.lru.size() > _segmentCapacity) {
+    segment.index.erase(segment.lru.back().first);
+    segment.lru.pop_back();
+  }
+}
+
+void RankingCache::clear() {
+  for (size_t s = 0; s < NUM_SEGMENTS; s++) {
+    indri::thread::ScopedLock lock(_segments[s].lock);
+    _segments[s].lru.clear();
+    _segments[s].index.clear();
+    _segments[s].generation++;
+  }
+}
+
+uint64_t RankingCache::hits() {
+  uint64_t total = 0;
+  for (size_t s = 0; s < NUM_SEGMENTS; s++) {
+    indri::thread::ScopedLock lock(_segments[s].lock);
+    total += _segments[s].hits;
+  }
+  return total;
+}
+
+uint64_t RankingCache::misses() {
+  uint64_t total = 0;
+  for (size_t s = 0; s < NUM_SEGMENTS; s++) {
+    indri::thread::ScopedLock lock(_segments[s].lock);
+    total += _segments[s].misses;
+  }
+  return total;
+}
+
+size_t RankingCache::size() {
+  size_t total = 0;
+  for (size_t s = 0; s < NUM_SEGMENTS; s++) {
+    indri::thread::ScopedLock lock(_segments[s].lock);
+    total += _segments[s].index.size();
+  }
+  return total;
+}
+
+RankingCache::Segment& RankingCache::_segment(const string& key) {
+  return _segments[boost::hash<string>()(key) % NUM_SEGMENTS];
+}
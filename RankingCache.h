@@ -0,0 +1,81 @@
+/*
+ * RankingCache.h
+ *
+ * Bounded LRU cache of shard rankings, keyed by the query's stems (sorted, so
+ * word order doesn't matter but repeated terms do) and the ranking parameters.
+ * Laid out like StemCache: entries are spread over segments by hash, each an
+ * LRU list with its own lock.
+ *
+ *  Created on: Mar 25, 2014
+ *      Author: yubink
+ */
+
+#ifndef RANKINGCACHE_H_
+#define RANKINGCACHE_H_
+
+#include "ShardScore.h"
+#include "indri/Mutex.hpp"
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <list>
+#include <utility>
+#include <boost/unordered_map.hpp>
+
+using namespace std;
+
+class RankingCache {
+public:
+  static const size_t NUM_SEGMENTS = 16;
+
+private:
+  typedef list<pair<string, vector<ShardScore> > > LruList;
+
+  struct Segment {
+    indri::thread::Mutex lock;
+    LruList lru; // most recently used first
+    boost::unordered_map<string, LruList::iterator> index;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t generation; // bumped by clear(), so rankings computed before it aren't put back
+
+    Segment(): hits(0), misses(0), generation(0) {};
+  };
+
+  Segment _segments[NUM_SEGMENTS];
+
+  // max # of rankings in one segment; 0 when the cache is off
+  size_t _segmentCapacity;
+
+public:
+  // capacity is the max # of rankings kept; 0 turns the cache off
+  RankingCache(size_t capacity = 0);
+
+  // changes the capacity and drops every ranking; must not be called while the cache is in use
+  void setCapacity(size_t capacity);
+
+  bool enabled() const;
+
+  // key for a query with the given stems (reordered), n_c and other ranking options
+  static string makeKey(vector<string> stems, uint n_c, const string& options);
+
+  // copies the cached ranking of key into ranking and returns true, or returns false and sets
+  // generation, which has to be passed to put() along with the ranking once it's computed
+  bool get(const string& key, vector<ShardScore>* ranking, uint64_t* generation);
+  void put(const string& key, const vector<ShardScore>& ranking, uint64_t generation);
+
+  // drops every ranking; to be called whenever the stats the rankings came from change
+  void clear();
+
+  // lookups answered from the cache and lookups that weren't
+  uint64_t hits();
+  uint64_t misses();
+
+  // # of rankings cached
+  size_t size();
+
+private:
+  Segment& _segment(const string& key);
+};
+
+#endif /* RANKINGCACHE_H_ */
@@ -0,0 +1,75 @@
+/*
+ * ScratchArena.cpp
+ *
+ *  Created on: Mar 20, 2014
+ *      Author: yubink
+ */
+
+#include "ScratchArena.h"
+#include <stdlib.h>
+#include <algorithm>
+#include <iostream>
+
+ScratchArena::ScratchArena() : _used(0), _allocated(0) {
+  _addBlock(MIN_BLOCK_SIZE);
+}
+
+ScratchArena::~ScratchArena() {
+  for (size_t b = 0; b < _blocks.size(); b++) {
+    free(_blocks[b]);
+  }
+}
+
+void ScratchArena::reset() {
+  // a query overflowed into extra blocks; replace them all with one block that would have fit it
+  if (_blocks.size() > 1) {
+    size_t size = _allocated;
+    for (size_t b = 0; b < _blocks.size(); b++) {
+      free(_blocks[b]);
+    }
+    _blocks.clear();
+    _blockSizes.clear();
+    _addBlock(size);
+  }
+  _used = 0;
+  _allocated = 0;
+}
+
+size_t ScratchArena::capacity() const {
+  size_t total = 0;
+  for (size_t b = 0; b < _blockSizes.size(); b++) {
+    total += _blockSizes[b];
+  }
+  return total;
+}
+
+void* ScratchArena::_alloc(size_t bytes) {
+  // keep every piece (and so the next one) aligned
+  bytes = (bytes + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
+  if (bytes == 0) {
+    bytes = ALIGNMENT;
+  }
+
+  if (_used + bytes > _blockSizes.back()) {
+    _addBlock(max(bytes, 2 * _blockSizes.back()));
+  }
+
+  void* piece = _blocks.back() + _used;
+  _used += bytes;
+  _allocated += bytes;
+  return piece;
+}
+
+void ScratchArena::_addBlock(size_t bytes) {
+  bytes = max(bytes, MIN_BLOCK_SIZE);
+  bytes = (bytes + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
+
+  void* block;
+  if (posix_memalign(&block, ALIGNMENT, bytes) != 0) {
+    cerr << "Couldn't allocate " << bytes << " bytes of scratch memory. Exiting." << endl;
+    exit(EXIT_FAILURE);
+  }
+  _blocks.push_back((char*) block);
+  _blockSizes.push_back(bytes);
+  _used = 0;
+}
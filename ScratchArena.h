@@ -0,0 +1,59 @@
+/*
+ * ScratchArena.h
+ *
+ * Bump allocator for the working arrays of one ranking. Pieces are cache line
+ * aligned and are all given back at once by reset(); the arena then keeps a
+ * single block big enough for the largest query seen so far, so once it has
+ * warmed up, ranking doesn't allocate.
+ *
+ *  Created on: Mar 20, 2014
+ *      Author: yubink
+ */
+
+#ifndef SCRATCHARENA_H_
+#define SCRATCHARENA_H_
+
+#include <stddef.h>
+#include <vector>
+
+using namespace std;
+
+class ScratchArena {
+public:
+  static const size_t ALIGNMENT = 64;
+  static const size_t MIN_BLOCK_SIZE = 64 * 1024;
+
+private:
+  // the last block is the one being filled
+  vector<char*> _blocks;
+  vector<size_t> _blockSizes;
+
+  // bytes used in the last block
+  size_t _used;
+
+  // bytes handed out since the last reset
+  size_t _allocated;
+
+public:
+  ScratchArena();
+  virtual ~ScratchArena();
+
+  // room for n uninitialized T's, aligned to ALIGNMENT; valid until reset()
+  template<class T>
+  T* alloc(size_t n) {
+    return (T*) _alloc(n * sizeof(T));
+  }
+
+  // releases everything handed out; memory is kept for the next use
+  void reset();
+
+  // bytes held by the arena
+  size_t capacity() const;
+
+private:
+  void* _alloc(size_t bytes);
+
+  void _addBlock(size_t bytes);
+};
+
+#endif /* SCRATCHARENA_H_ */
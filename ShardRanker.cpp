@@ -6,22 +6,68 @@
  */
 
 #include "ShardRanker.h"
+#include "GammaKernel.h"
+#include "indri/ScopedLock.hpp"
 #include <math.h>
+#include <stdio.h>
+#include <algorithm>
 #include <boost/math/distributions/gamma.hpp>
+#include <boost/math/special_functions/fpclassify.hpp>
 #include "boost/filesystem.hpp"
 
 using namespace boost::filesystem;
 
+// doubles of scratch space _getProbabilities needs per shard: k, theta and p, plus the kernel's
+static const size_t PROBABILITY_WORK_SIZE = 3 + GAMMA_WORK_SIZE;
+
 ShardRanker::ShardRanker(vector<string> dbPaths,
-    indri::collection::Repository* repo, uint n_c) :
-    _repo(repo), _numShards(dbPaths.size() - 1), _n_c(n_c) {
+    indri::collection::Repository* repo, uint n_c, int cache) :
+    _inverted(NULL), _env(NULL), _preloaded(false), _repo(repo),
+    _normalizer(repo == NULL ? new TermNormalizer(dbPaths[0]) : NULL), _stemCache(repo, _normalizer), _numShards(dbPaths.size() - 1), _n_c(n_c),
+    _fastError(0.0), _boostMode(false) {
   for (uint i = 0; i < dbPaths.size(); i++) {
-    _stores.push_back(new FeatureStore(dbPaths[i], true));
-
     // get a mapping between integer ids which we use internally and the external shardname
     path dbPath(dbPaths[i]);
     _shardIds.push_back(dbPath.filename().string());
   }
+
+  // one cache for every db, rather than a separate one per db
+  _env = FeatureStore::openEnv(cache);
+
+  // the corpus store is always needed
+  _stores.push_back(new FeatureStore(dbPaths[0], true, cache, _env));
+
+  // use the inverted store built by 'Taily invert' if it was built for exactly these shards
+  if (exists(path(dbPaths[0]) / InvertedStore::FILE_NAME)) {
+    _inverted = new InvertedStore(dbPaths[0], true, cache, _env);
+
+    vector<string> names;
+    _inverted->getShardNames(&names);
+    if (names.size() != _numShards || !std::equal(names.begin(), names.end(), _shardIds.begin() + 1)
+        || _inverted->getShardSizes(&_shardSizes) != 0 || _shardSizes.size() != _numShards + 1) {
+      cerr << "Inverted store in " << dbPaths[0] << " was built for a different shard list; ignoring it." << endl;
+      delete _inverted;
+      _inverted = NULL;
+      _shardSizes.clear();
+    } else {
+      // a shard db rebuilt under the same name has other stats than the ones inverted
+      vector<int64_t> builtStamps, stamps;
+      for (uint i = 1; i < dbPaths.size(); i++) {
+        InvertedStore::appendShardStamps(dbPaths[i], &stamps);
+      }
+      if (_inverted->getShardStamps(&builtStamps) != 0 || builtStamps != stamps) {
+        cerr << "Inverted store in " << dbPaths[0] << " was built from older versions of its shard dbs; ignoring it. "
+            << "Rebuild it with Taily invert." << endl;
+        delete _inverted;
+        _inverted = NULL;
+        _shardSizes.clear();
+      }
+    }
+  }
+
+  for (uint i = 1; i < dbPaths.size(); i++) {
+    _stores.push_back(_inverted ? NULL : new FeatureStore(dbPaths[i], true, cache, _env));
+  }
 }
 
 ShardRanker::~ShardRanker() {
@@ -29,17 +75,301 @@ ShardRanker::~ShardRanker() {
   for (it = _stores.begin(); it != _stores.end(); ++it) {
     delete (*it);
   }
+  delete _inverted;
+  delete _normalizer;
+
+  vector<ScratchArena*>::iterator sit;
+  for (sit = _scratchPool.begin(); sit != _scratchPool.end(); ++sit) {
+    delete (*sit);
+  }
+
+  // dbs must be closed before their environment
+  FeatureStore::closeEnv(_env);
+}
+
+void ShardRanker::setFastMode(double relError) {
+  _fastError = (relError > 0) ? relError : 0.0;
+}
+
+void ShardRanker::setBoostMode(bool boost) {
+  _boostMode = boost;
+}
+
+void ShardRanker::setRankingCache(size_t capacity) {
+  _rankingCache.setCapacity(capacity);
+}
+
+RankingCache& ShardRanker::rankingCache() {
+  return _rankingCache;
+}
+
+string ShardRanker::_rankingKey(const vector<string>& stems, bool includeZeroScores) {
+  char options[64];
+  snprintf(options, sizeof(options), "%c%g", includeZeroScores ? 'z' : '-', _boostMode ? -1.0 : _fastError);
+  return RankingCache::makeKey(stems, _n_c, options);
+}
+
+uint ShardRanker::numShards() const {
+  return _numShards;
+}
+
+const string& ShardRanker::shardName(uint shard) const {
+  return _shardIds[shard];
+}
+
+StemCache& ShardRanker::stemCache() {
+  return _stemCache;
+}
+
+bool ShardRanker::init(int budget) {
+  // rankings from before may have been made with other stats
+  _rankingCache.clear();
+
+  // shard sizes are needed by every query
+  if (_shardSizes.empty()) {
+    vector<double> sizes;
+    for (uint i = 0; i < _numShards + 1; i++) {
+      sizes.push_back(_getShardSize(i));
+    }
+    _shardSizes.swap(sizes);
+  }
+
+  if (budget <= 0) {
+    return false;
+  }
+  size_t budgetBytes = (size_t) budget * 1024 * 1024;
+
+  _preloaded = false;
+  _preloadedTerms.clear();
+  _preloadedStats.clear();
+
+  // every stem of the corpus db (the ones with a ctf)
+  vector<string> stems;
+  FeatureStore::TermIterator* termit = _stores[0]->getTermIterator();
+  for (; !termit->finished(); termit->nextTerm()) {
+    stems.push_back(termit->currrentEntry().first);
+  }
+  delete termit;
+
+  // corpus-wide stats, in batches
+  const size_t batchSize = 10000;
+  size_t used = 0;
+  for (size_t start = 0; start < stems.size(); start += batchSize) {
+    vector<string> batch(stems.begin() + start, stems.begin() + min(start + batchSize, stems.size()));
+    vector<double> mins, dfs;
+    vector<bool> hasMin;
+    _getCorpusStats(batch, &mins, &hasMin, &dfs);
+
+    for (size_t j = 0; j < batch.size(); j++) {
+      PreloadedTerm& term = _preloadedTerms[batch[j]];
+      term.corpusMin = mins[j];
+      term.hasCorpusMin = hasMin[j];
+      term.corpusDf = dfs[j];
+
+      // rough size of a table node with its stem
+      used += sizeof(PreloadedTerm) + batch[j].size() + 64;
+    }
+    if (used > budgetBytes) {
+      break;
+    }
+  }
+
+  if (used > budgetBytes || !_preloadShardStats(budgetBytes, used)) {
+    cerr << "Term stats don't fit in " << budget << "MB; not preloading them." << endl;
+    _preloadedTerms.clear();
+    _preloadedStats.clear();
+    return false;
+  }
+
+  _preloaded = true;
+  return true;
+}
+
+bool ShardRanker::_preloadShardStats(size_t budget, size_t used) {
+  // shard entries are collected shard by shard and then grouped by stem; end counts the
+  // entries of a stem until the groups are laid out
+  vector<pair<PreloadedTerm*, ShardTermStats> > entries;
+  size_t entrySize = sizeof(pair<PreloadedTerm*, ShardTermStats>) + sizeof(ShardTermStats);
+
+  boost::unordered_map<string, PreloadedTerm>::iterator tit;
+  ShardTermStats entry;
+  if (_inverted) {
+    vector<ShardTermStats> list;
+    for (tit = _preloadedTerms.begin(); tit != _preloadedTerms.end(); ++tit) {
+      _inverted->getShardStats(tit->first.c_str(), &list);
+      vector<ShardTermStats>::iterator lit;
+      for (lit = list.begin(); lit != list.end(); ++lit) {
+        entries.push_back(make_pair(&tit->second, *lit));
+        tit->second.end++;
+      }
+      if (used + entries.size() * entrySize > budget) {
+        return false;
+      }
+    }
+  } else {
+    // the corpus stems older shards are probed for, gathered once at the first such shard
+    vector<string> stems;
+    vector<PreloadedTerm*> terms;
+    vector<FeatureStore::TermStats> stats;
+    vector<bool> found;
+    for (uint i = 1; i <= _numShards; i++) {
+      entry.shard = i;
+
+      if (_stores[i]->isPacked()) {
+        // packed shards can simply be walked
+        FeatureStore::TermIterator* it = _stores[i]->getTermStatsIterator();
+        for (; !it->finished(); it->nextTerm()) {
+          entry.stats = it->currentTermStats();
+          tit = _preloadedTerms.find(it->currrentEntry().first);
+          if (tit == _preloadedTerms.end() || entry.stats.df == 0) {
+            continue;
+          }
+          entries.push_back(make_pair(&tit->second, entry));
+          tit->second.end++;
+        }
+        delete it;
+      } else {
+        // older shards are probed for every corpus stem
+        if (stems.empty()) {
+          for (tit = _preloadedTerms.begin(); tit != _preloadedTerms.end(); ++tit) {
+            stems.push_back(tit->first);
+            terms.push_back(&tit->second);
+          }
+        }
+        _stores[i]->getTermStats(stems, &stats, &found);
+        for (size_t j = 0; j < stems.size(); j++) {
+          if (!found[j] || stats[j].df == 0) {
+            continue;
+          }
+          entry.stats = stats[j];
+          entries.push_back(make_pair(terms[j], entry));
+          terms[j]->end++;
+        }
+      }
+
+      if (used + entries.size() * entrySize > budget) {
+        return false;
+      }
+    }
+  }
+
+  // lay out the groups; entries of a stem stay in shard order
+  size_t offset = 0;
+  for (tit = _preloadedTerms.begin(); tit != _preloadedTerms.end(); ++tit) {
+    tit->second.begin = offset;
+    offset += tit->second.end;
+    tit->second.end = tit->second.begin;
+  }
+  _preloadedStats.resize(offset);
+
+  vector<pair<PreloadedTerm*, ShardTermStats> >::iterator eit;
+  for (eit = entries.begin(); eit != entries.end(); ++eit) {
+    _preloadedStats[eit->first->end++] = eit->second;
+  }
+  return true;
+}
+
+void ShardRanker::_getCorpusStats(const vector<string>& stems, vector<double>* mins, vector<bool>* hasMin,
+    vector<double>* dfs) {
+  uint numStems = stems.size();
+  mins->assign(numStems, DBL_MAX);
+  hasMin->assign(numStems, false);
+  dfs->assign(numStems, 0.0);
+
+  if (_preloaded) {
+    for (uint j = 0; j < numStems; j++) {
+      boost::unordered_map<string, PreloadedTerm>::iterator it = _preloadedTerms.find(stems[j]);
+      if (it != _preloadedTerms.end()) {
+        (*mins)[j] = it->second.corpusMin;
+        (*hasMin)[j] = it->second.hasCorpusMin;
+        (*dfs)[j] = it->second.corpusDf;
+      }
+    }
+    return;
+  }
+
+  // minimum feature values and dfs of all stems in one batch
+  vector<string> corpusKeys;
+  for (uint j = 0; j < numStems; j++) {
+    corpusKeys.push_back(stems[j] + FeatureStore::MIN_FEAT_SUFFIX);
+  }
+  for (uint j = 0; j < numStems; j++) {
+    corpusKeys.push_back(stems[j] + FeatureStore::SIZE_FEAT_SUFFIX);
+  }
+  vector<double> corpusVals;
+  vector<bool> corpusFound;
+  _stores[0]->getFeatures(corpusKeys, &corpusVals, &corpusFound);
+
+  for (uint j = 0; j < numStems; j++) {
+    if (corpusFound[j]) {
+      (*mins)[j] = corpusVals[j];
+      (*hasMin)[j] = true;
+    }
+    (*dfs)[j] = corpusVals[numStems + j];
+  }
+}
+
+void ShardRanker::_getShardStats(const vector<string>& stems, vector<vector<ShardTermStats> >* output) {
+  output->clear();
+  output->resize(stems.size());
+
+  if (_preloaded) {
+    for (uint j = 0; j < stems.size(); j++) {
+      boost::unordered_map<string, PreloadedTerm>::iterator it = _preloadedTerms.find(stems[j]);
+      if (it != _preloadedTerms.end()) {
+        (*output)[j].assign(_preloadedStats.begin() + it->second.begin, _preloadedStats.begin() + it->second.end);
+      }
+    }
+    return;
+  }
+
+  // one lookup per stem returns every shard containing it
+  if (_inverted) {
+    for (uint j = 0; j < stems.size(); j++) {
+      _inverted->getShardStats(stems[j].c_str(), &(*output)[j]);
+    }
+    return;
+  }
+
+  // otherwise fetch all stems from each shard store in one batch
+  vector<FeatureStore::TermStats> stats;
+  vector<bool> found;
+  ShardTermStats entry;
+  for (uint i = 1; i <= _numShards; i++) {
+    _stores[i]->getTermStats(stems, &stats, &found);
+
+    for (uint j = 0; j < stems.size(); j++) {
+      if (!found[j] || stats[j].df == 0)
+        continue;
+      entry.shard = i;
+      entry.stats = stats[j];
+      (*output)[j].push_back(entry);
+    }
+  }
+}
+
+double ShardRanker::_getShardSize(uint i) {
+  if (!_shardSizes.empty()) {
+    return _shardSizes[i];
+  }
+
+  double shardSize = 0;
+  string sizeKey(FeatureStore::SIZE_FEAT_SUFFIX);
+  _stores[i]->getFeature((char*) sizeKey.c_str(), &shardSize);
+  return shardSize;
 }
 
 void ShardRanker::_getStems(string query, vector<string>* output) {
-  char mutableLine[query.size() + 1];
-  std::strcpy(mutableLine, query.c_str());
+  // on the heap; a served query can be large enough to overflow a worker thread's stack
+  vector<char> mutableLine(query.begin(), query.end());
+  mutableLine.push_back('\0');
 
-  for (char* value = std::strtok(mutableLine, " "); value != NULL; value =
-      std::strtok(NULL, " ")) {
+  // strtok_r; strtok keeps its position in a static
+  char* pos;
+  for (char* value = strtok_r(&mutableLine[0], " ", &pos); value != NULL; value =
+      strtok_r(NULL, " ", &pos)) {
     // tokenize and stem/stop query
-    string term(value);
-    string stem = _repo->processTerm(term);
+    string stem = _stemCache.stem(value);
 
     // if stopword, skip to next term
     if (stem.length() == 0)
@@ -49,132 +379,155 @@ void ShardRanker::_getStems(string query, vector<string>* output) {
   }
 }
 
-void ShardRanker::_getQueryFeats(vector<string>& stems, double* queryMean,
-    double* queryVar, bool* hasATerm, double* dfTerm) {
-  // calculate mean and variances for query for all shards
-  vector<string>::iterator it;
+void ShardRanker::_getStemStats(const vector<string>& stems, vector<StemStats>* output) {
+  vector<double> mins, dfs;
+  vector<bool> hasMin;
+  _getCorpusStats(stems, &mins, &hasMin, &dfs);
 
-  for (it = stems.begin(); it != stems.end(); ++it) {
-    string stem = (*it);
+  vector<vector<ShardTermStats> > shardStats;
+  _getShardStats(stems, &shardStats);
 
-    // get minimum doc feature value for this stem
-    double minVal = DBL_MAX;
-    string minFeat(stem);
-    minFeat.append(FeatureStore::MIN_FEAT_SUFFIX);
-    int found = _stores[0]->getFeature((char*) minFeat.c_str(), &minVal);
+  output->clear();
+  output->resize(stems.size());
+  for (uint j = 0; j < stems.size(); j++) {
+    StemStats& stats = (*output)[j];
+    stats.corpusMin = mins[j];
+    stats.hasCorpusMin = hasMin[j];
+    stats.corpusDf = dfs[j];
+    stats.shards.swap(shardStats[j]);
+  }
+}
+
+void ShardRanker::_getActiveShards(vector<const StemStats*>& stemStats, vector<uint>* shards) {
+  shards->clear();
+  shards->push_back(0);
 
-    bool calcMin = false;
-    if (found != 0) {
-      calcMin = true;
+  vector<const StemStats*>::iterator lit;
+  for (lit = stemStats.begin(); lit != stemStats.end(); ++lit) {
+    vector<ShardTermStats>::const_iterator sit;
+    for (sit = (*lit)->shards.begin(); sit != (*lit)->shards.end(); ++sit) {
+      if (sit->stats.df > 0) {
+        shards->push_back(sit->shard);
+      }
     }
+  }
+
+  sort(shards->begin() + 1, shards->end());
+  shards->erase(unique(shards->begin() + 1, shards->end()), shards->end());
+}
+
+void ShardRanker::_getQueryFeats(vector<string>& stems, vector<const StemStats*>& stemStats,
+    vector<uint>& shards, double* queryMean, double* queryVar, bool* hasATerm, double* dfTerm, double* shardDfs) {
+  // calculate mean and variances for query for all shards
+  uint numStems = stems.size();
+
+  for (uint j = 0; j < numStems; j++) {
+    // the corpus-wide df is used in _getAll
+    shardDfs[j] = stemStats[j]->corpusDf;
+
+    // get minimum doc feature value for this stem
+    double minVal = stemStats[j]->corpusMin;
+    bool calcMin = !stemStats[j]->hasCorpusMin;
 
     // sums of individual shard features to calculate corpus-wide feature
     double globalFSum = 0;
     double globalF2Sum = 0;
     double globalDf = 0;
 
-    // keep track of how many times this term appeared in the shards for minVal later
-    double dfCache[_numShards+1];
-    for(uint i = 0; i <= _numShards; i++) {
-      dfCache[i] = 0;
-    }
-
-    // for each shard (not including whole corpus db), calculate mean/var
+    // for each shard containing the stem (not including whole corpus db), calculate mean/var
     // keep track of totals to use in the corpus-wide features
-    for (uint i = 1; i <= _numShards; i++) {
+    const vector<ShardTermStats>& shardStats = stemStats[j]->shards;
+
+    // local index of each shard of the stem
+    vector<uint> local(shardStats.size(), 0);
+
+    for (uint s = 0; s < shardStats.size(); s++) {
+      const FeatureStore::TermStats& stats = shardStats[s].stats;
+
       // get current term's shard df
-      double df = 0;
-      string dfFeat(stem);
-      dfFeat.append(FeatureStore::SIZE_FEAT_SUFFIX);
-      _stores[i]->getFeature((char*) dfFeat.c_str(), &df);
-      dfCache[i] = df;
+      double df = stats.df;
       globalDf += df;
 
       // if this shard doesn't have this term, skip; otherwise you get nan everywhere
       if (df == 0)
         continue;
+
+      // both lists are sorted by shard id
+      uint i = lower_bound(shards.begin() + 1, shards.end(), shardStats[s].shard) - shards.begin();
+      local[s] = i;
+
+      shardDfs[i*numStems + j] = df;
       hasATerm[i] = true;
       dfTerm[i] = df;
       dfTerm[0] += df;
 
       // add current term's mean to shard; also shift by min feat value Eq (5)
-      double fSum = 0;
-      string meanFeat(stem);
-      meanFeat.append(FeatureStore::FEAT_SUFFIX);
-      _stores[i]->getFeature((char*) meanFeat.c_str(), &fSum);
+      double fSum = stats.f;
       //queryMean[i] += fSum/df - minVal;
       queryMean[i] += fSum / df; // handle min values separately afterwards
       globalFSum += fSum;
 
       // add current term's variance to shard Eq (6)
-      double f2Sum = 0;
-      string f2Feat(stem);
-      f2Feat.append(FeatureStore::SQUARED_FEAT_SUFFIX);
-      _stores[i]->getFeature((char*) f2Feat.c_str(), &f2Sum);
+      double f2Sum = stats.f2;
       queryVar[i] += f2Sum / df - pow(fSum / df, 2);
       globalF2Sum += f2Sum;
 
       // if there is no global min stored, figure out the minimum from shards
       if (calcMin) {
-        double currMin;
-        string minFeat(stem);
-        minFeat.append(FeatureStore::MIN_FEAT_SUFFIX);
-        _stores[i]->getFeature((char*) minFeat.c_str(), &currMin);
-        if (currMin < minVal) {
-          minVal = currMin;
+        if (stats.min < minVal) {
+          minVal = stats.min;
         }
       }
     }
 
-    dfCache[0] = globalDf;
     if (globalDf > 0) {
       hasATerm[0] = true;
 
       // calculate global mean/variances based on shard sums; again, minVal is for later
       queryMean[0] += globalFSum / globalDf;
       queryVar[0] += globalF2Sum / globalDf - pow(globalFSum / globalDf, 2);
+
+      // adjust corpus mean by minimum value
+      queryMean[0] -= minVal;
     }
 
     // adjust shard mean by minimum value
-    for (uint i = 0; i <= _numShards; i++) {
-      if (dfCache[i] > 0) {
+    for (uint s = 0; s < shardStats.size(); s++) {
+      if (shardStats[s].stats.df > 0) {
     	// FIXME: removes shard corresponding to minVal?
-        queryMean[i] -= minVal;
+        queryMean[local[s]] -= minVal;
       }
     }
   }
 }
 
-void ShardRanker::_getAll(vector<string>& stems, double* all) {
+void ShardRanker::_getAll(vector<string>& stems, vector<uint>& shards, double* shardDfs, double* all,
+    ScratchArena& scratch) {
   // calculate Any_i & all_i
-  double any[_numShards + 1];
-  string sizeKey(FeatureStore::SIZE_FEAT_SUFFIX);
+  uint numActive = shards.size();
+  double* any = scratch.alloc<double>(numActive);
+  uint numStems = stems.size();
+  double* dfs = scratch.alloc<double>(numStems);
 
-  for (int i = 0; i < _numShards + 1; i++) {
+  for (uint i = 0; i < numActive; i++) {
     // initialize Any_i & all_i
     any[i] = 1.0;
     all[i] = 0.0;
 
     // get size of current shard
-    double shardSize;
-    _stores[i]->getFeature((char*) sizeKey.c_str(), &shardSize);
+    double shardSize = _getShardSize(shards[i]);
 
     // for each query term, calculate inner bracket of any_i equation
-    vector<string>::iterator it;
-    double dfs[stems.size()];
-    int dfCnt = 0;
-    for (it = stems.begin(); it != stems.end(); ++it) {
-      string stem(*it);
-      stem.append(FeatureStore::SIZE_FEAT_SUFFIX);
-      double df;
-      _stores[i]->getFeature((char*) stem.c_str(), &df);
+    for (uint j = 0; j < numStems; j++) {
+      // dfs were already fetched along with the other term stats
+      double df = shardDfs[i*numStems + j];
 
       // no smoothing
       if (df < 1)
         df = 0;
 
       // store df for all_i calculation
-      dfs[dfCnt++] = df;
+      dfs[j] = df;
 
       any[i] *= (1 - df / shardSize);
     }
@@ -184,85 +537,318 @@ void ShardRanker::_getAll(vector<string>& stems, double* all) {
 
     // calculation of all_i Eq (10)
     all[i] = any[i];
-    for (int j = 0; j < stems.size(); j++) {
+    for (uint j = 0; j < numStems; j++) {
       all[i] *= dfs[j] / any[i];
     }
 
   }
 }
 
+static bool shardIdLess(const ShardScore& i, const ShardScore& j) {
+  return i.shard < j.shard;
+}
+
+void ShardRanker::_addZeroScores(vector<uint>& shards, vector<ShardScore>* ranking) {
+  // both are sorted by shard id
+  size_t numScored = ranking->size();
+  uint next = 1;
+  for (uint i = 1; i < _numShards + 1; i++) {
+    if (next < shards.size() && shards[next] == i) {
+      next++;
+      continue;
+    }
+    ranking->push_back(ShardScore(i, 0));
+  }
+
+  // back into shard id order, as if every shard had been scored in turn; the unsorted
+  // degenerate cases keep that order and the sort sees the same input for any shard list
+  inplace_merge(ranking->begin(), ranking->begin() + numScored, ranking->end(), shardIdLess);
+}
+
 //reverse sort order
-bool shardPairSort(pair<string, double> i, pair<string, double> j) {
-  return (i.second > j.second);
+void ShardRanker::rank(string query, vector<ShardScore>* ranking, bool includeZeroScores) {
+  ranking->clear();
+
+  vector<string> stems;
+  _getStems(query, &stems);
+
+  string key;
+  uint64_t generation = 0;
+  if (_rankingCache.enabled()) {
+    key = _rankingKey(stems, includeZeroScores);
+    if (_rankingCache.get(key, ranking, &generation)) {
+      return;
+    }
+  }
+
+  // stats of every stem in the corpus and in every shard that has it
+  vector<StemStats> stats;
+  _getStemStats(stems, &stats);
+
+  vector<const StemStats*> stemStats;
+  for (uint j = 0; j < stems.size(); j++) {
+    stemStats.push_back(&stats[j]);
+  }
+
+  ScratchArena* scratch = _takeScratch();
+  _rankStems(stems, stemStats, ranking, includeZeroScores, *scratch);
+  _returnScratch(scratch);
+
+  if (_rankingCache.enabled()) {
+    _rankingCache.put(key, *ranking, generation);
+  }
+}
+
+void ShardRanker::rank(string query, vector<pair<string, double> >* ranking, bool includeZeroScores) {
+  vector<ShardScore> scores;
+  rank(query, &scores, includeZeroScores);
+
+  vector<ShardScore>::iterator it;
+  for (it = scores.begin(); it != scores.end(); ++it) {
+    ranking->push_back(make_pair(_shardIds[it->shard], it->score));
+  }
+}
+
+void ShardRanker::rankTop(string query, vector<ShardScore>* ranking, double v, uint maxK) {
+  ranking->clear();
+
+  Selection selection;
+  selection.v = v;
+  selection.maxK = maxK;
+
+  // the selection of a cached full ranking is the same as the selective ranking
+  if (_rankingCache.enabled()) {
+    rank(query, ranking);
+    _applySelection(selection, ranking);
+    return;
+  }
+
+  vector<string> stems;
+  _getStems(query, &stems);
+
+  vector<StemStats> stats;
+  _getStemStats(stems, &stats);
+
+  vector<const StemStats*> stemStats;
+  for (uint j = 0; j < stems.size(); j++) {
+    stemStats.push_back(&stats[j]);
+  }
+
+  ScratchArena* scratch = _takeScratch();
+  _rankStems(stems, stemStats, ranking, false, *scratch, &selection);
+  _returnScratch(scratch);
+}
+
+void ShardRanker::rankSweep(string query, const vector<uint>& n_cs, vector<vector<ShardScore> >* rankings,
+    bool includeZeroScores) {
+  // the rankings' buffers are reused when the caller passes the same vector again
+  rankings->resize(n_cs.size());
+  vector<vector<ShardScore>*> outputs;
+  for (size_t c = 0; c < n_cs.size(); c++) {
+    (*rankings)[c].clear();
+    outputs.push_back(&(*rankings)[c]);
+  }
+  if (n_cs.empty()) {
+    return;
+  }
+
+  vector<string> stems;
+  _getStems(query, &stems);
+
+  vector<StemStats> stats;
+  _getStemStats(stems, &stats);
+
+  vector<const StemStats*> stemStats;
+  for (uint j = 0; j < stems.size(); j++) {
+    stemStats.push_back(&stats[j]);
+  }
+
+  ScratchArena* scratch = _takeScratch();
+  _rankStemsSweep(stems, stemStats, &n_cs[0], &outputs[0], n_cs.size(), includeZeroScores, *scratch);
+  _returnScratch(scratch);
 }
 
-void ShardRanker::rank(string query, vector<pair<string, double> >* ranking) {
-  // +1 because 0 stands for central db
-  double queryMean[_numShards + 1];
-  double queryVar[_numShards + 1];
-  bool hasATerm[_numShards + 1]; // to mark shards that have at least one doc for one query term
-  double dfTerm[_numShards + 1]; // used in the ranking for var ~= 0 cases
+void ShardRanker::rankBatch(const vector<string>& queries, vector<vector<ShardScore> >* rankings,
+    bool includeZeroScores) {
+  // the rankings' buffers are reused when the caller passes the same vector again
+  rankings->resize(queries.size());
+
+  // stem every query and give each distinct stem one slot; queries found in the ranking cache
+  // are done right away and don't need their stems fetched
+  vector<vector<string> > queryStems(queries.size());
+  vector<vector<size_t> > querySlots(queries.size());
+  vector<bool> cached(queries.size(), false);
+  vector<string> keys(queries.size());
+  vector<uint64_t> generations(queries.size(), 0);
+  boost::unordered_map<string, size_t> slots;
+  vector<string> distinctStems;
+
+  for (size_t q = 0; q < queries.size(); q++) {
+    (*rankings)[q].clear();
+    _getStems(queries[q], &queryStems[q]);
+
+    if (_rankingCache.enabled()) {
+      keys[q] = _rankingKey(queryStems[q], includeZeroScores);
+      cached[q] = _rankingCache.get(keys[q], &(*rankings)[q], &generations[q]);
+      if (cached[q]) {
+        continue;
+      }
+    }
+
+    vector<string>::iterator it;
+    for (it = queryStems[q].begin(); it != queryStems[q].end(); ++it) {
+      boost::unordered_map<string, size_t>::iterator sit = slots.find(*it);
+      if (sit == slots.end()) {
+        sit = slots.insert(make_pair(*it, distinctStems.size())).first;
+        distinctStems.push_back(*it);
+      }
+      querySlots[q].push_back(sit->second);
+    }
+  }
+
+  // one fetch for the whole vocabulary of the batch
+  vector<StemStats> stats;
+  _getStemStats(distinctStems, &stats);
+
+  ScratchArena* scratch = _takeScratch();
+  for (size_t q = 0; q < queries.size(); q++) {
+    if (cached[q]) {
+      continue;
+    }
+
+    vector<const StemStats*> stemStats;
+    for (size_t j = 0; j < querySlots[q].size(); j++) {
+      stemStats.push_back(&stats[querySlots[q][j]]);
+    }
+    _rankStems(queryStems[q], stemStats, &(*rankings)[q], includeZeroScores, *scratch);
+
+    if (_rankingCache.enabled()) {
+      _rankingCache.put(keys[q], (*rankings)[q], generations[q]);
+    }
+  }
+  _returnScratch(scratch);
+}
+
+ScratchArena* ShardRanker::_takeScratch() {
+  indri::thread::ScopedLock lock(_scratchLock);
+  if (_scratchPool.empty()) {
+    return new ScratchArena();
+  }
+  ScratchArena* scratch = _scratchPool.back();
+  _scratchPool.pop_back();
+  return scratch;
+}
+
+void ShardRanker::_returnScratch(ScratchArena* scratch) {
+  indri::thread::ScopedLock lock(_scratchLock);
+  _scratchPool.push_back(scratch);
+}
+
+void ShardRanker::_rankStems(vector<string>& stems, vector<const StemStats*>& stemStats,
+    vector<ShardScore>* ranking, bool includeZeroScores, ScratchArena& scratch, const Selection* selection) {
+  _rankStemsSweep(stems, stemStats, &_n_c, &ranking, 1, includeZeroScores, scratch, selection);
+}
+
+void ShardRanker::_rankStemsSweep(vector<string>& stems, vector<const StemStats*>& stemStats,
+    const uint* n_cs, vector<ShardScore>** rankings, uint numSettings, bool includeZeroScores,
+    ScratchArena& scratch, const Selection* selection) {
+  scratch.reset();
+
+  // everything below only covers the shards that contain a query term; shards[i] is the
+  // shard id of local index i, and local index 0 stands for central db
+  vector<uint> shards;
+  _getActiveShards(stemStats, &shards);
+  uint numActive = shards.size();
+
+  double* queryMean = scratch.alloc<double>(numActive);
+  double* queryVar = scratch.alloc<double>(numActive);
+  bool* hasATerm = scratch.alloc<bool>(numActive); // to mark shards that have at least one doc for one query term
+  double* dfTerm = scratch.alloc<double>(numActive); // used in the ranking for var ~= 0 cases
 
   // query total means and variances for each shard
-  for (int i = 0; i < _numShards + 1; i++) {
+  for (uint i = 0; i < numActive; i++) {
     queryMean[i] = queryVar[i] = 0.0;
     hasATerm[i] = false;
     dfTerm[i] = 0.0;
   }
-  vector<string> stems;
-  _getStems(query, &stems);
-  _getQueryFeats(stems, queryMean, queryVar, hasATerm, dfTerm);
+
+  // df of each stem in each shard, shard-major; filled in by _getQueryFeats
+  double* shardDfs = scratch.alloc<double>(numActive * stems.size());
+  for (uint i = 0; i < numActive * stems.size(); i++) {
+    shardDfs[i] = 0.0;
+  }
+  _getQueryFeats(stems, stemStats, shards, queryMean, queryVar, hasATerm, dfTerm, shardDfs);
 
   // fast fall-through for 2 degenerate cases
   if (!hasATerm[0]) {
     // case 1: there are no documents in the entire collection that matches any query term
     // return empty ranking
     return;
-  } else if (queryVar[0] < 1e-10) {
+  }
+
+  if (queryVar[0] < 1e-10) {
     // FIXME: these var ~= 0 cases should really be handled more carefully; instead of
     // n_i = 1, it could be there are two or more very similarly scoring docs; I should keep
     // track of the df of these shards and use that instead of n_i = 1...
 
     // case 2: there is only 1 document in entire collection that matches any query term
-    // return the shard with the document with n_i = 1
-    for (int i = 1; i < _numShards + 1; i++) {
-      if (hasATerm[i]) {
-        ranking->push_back(make_pair(_shardIds[i], dfTerm[i]));
-      } else {
-    	ranking->push_back(make_pair(_shardIds[i], 0));
+    // return the shard with the document with n_i = 1; the same for every n_c
+    for (uint c = 0; c < numSettings; c++) {
+      vector<ShardScore>* ranking = rankings[c];
+      for (uint i = 1; i < numActive; i++) {
+        if (hasATerm[i]) {
+          ranking->push_back(ShardScore(shards[i], dfTerm[i]));
+        } else {
+          ranking->push_back(ShardScore(shards[i], 0));
+        }
+      }
+      if (includeZeroScores) {
+        _addZeroScores(shards, ranking);
+      }
+      if (selection) {
+        _applySelection(*selection, ranking);
       }
     }
     return;
   }
 
   // all from Eq (10)
-  double all[_numShards + 1];
-  for (int i = 0; i < _numShards + 1; i++) {
+  double* all = scratch.alloc<double>(numActive);
+  for (uint i = 0; i < numActive; i++) {
     all[i] = 0.0;
   }
-  _getAll(stems, all);
+  _getAll(stems, shards, shardDfs, all, scratch);
 
   // fast fall-through for for 1 degenerate case
   if (all[0] < 1e-10) {
 	// if all[0] is ~= 0, then all[i] is ~= 0 because no shard contains all of the query terms
 	// these all[0] ~= 0 cases should be handled carefully; instead of just using queryMean,
 	// it could be more effective calculating *all* again for the maximum number of query terms
-	for (int i = 1; i < _numShards + 1; i++) {
-	  if (hasATerm[i]) {
-	    // actually use mean of the shard as score
-		ranking->push_back(make_pair(_shardIds[i], queryMean[i]));
-      } else {
-        ranking->push_back(make_pair(_shardIds[i], 0));
+	for (uint c = 0; c < numSettings; c++) {
+	  vector<ShardScore>* ranking = rankings[c];
+	  for (uint i = 1; i < numActive; i++) {
+	    if (hasATerm[i]) {
+	      // actually use mean of the shard as score
+	      ranking->push_back(ShardScore(shards[i], queryMean[i]));
+	    } else {
+	      ranking->push_back(ShardScore(shards[i], 0));
+	    }
+	  }
+	  if (includeZeroScores) {
+	    _addZeroScores(shards, ranking);
+	  }
+	  if (selection) {
+	    _applySelection(*selection, ranking);
 	  }
 	}
 	return;
   }
 
   // calculate k and theta from mean/vars Eq (7) (8)
-  double k[_numShards + 1];
-  double theta[_numShards + 1];
+  double* k = scratch.alloc<double>(numActive);
+  double* theta = scratch.alloc<double>(numActive);
 
-  for (int i = 0; i < _numShards + 1; i++) {
+  for (uint i = 0; i < numActive; i++) {
     // special case, if df = 1, then var ~= 0 (or if no terms occur in shard)
     if (queryVar[i] < 1e-10) {
   	  k[i] = -1;
@@ -274,53 +860,253 @@ void ShardRanker::rank(string query, vector<pair<string, double> >* ranking) {
     theta[i] = queryVar[i] / queryMean[i];
   }
 
-  // calculate s_c from inline equation after Eq (11)
-  double p_c = _n_c / all[0];
+  // shards with a distribution, whose p_i is computed by the gamma kernel
+  double* p = scratch.alloc<double>(numActive);
+  uint* gammaShard = scratch.alloc<uint>(numActive);
+  uint numGamma = 0;
+  for (uint i = 1; i < numActive; i++) {
+    if (hasATerm[i] && queryVar[i] >= 1e-10) {
+      gammaShard[numGamma++] = i;
+    }
+  }
+  double* work = scratch.alloc<double>(PROBABILITY_WORK_SIZE * numGamma);
+
+  // the rest depends on n_c; the per-shard gamma parameters above are shared by every setting
+  for (uint c = 0; c < numSettings; c++) {
+    uint n_c = n_cs[c];
+    vector<ShardScore>* ranking = rankings[c];
 
-  // if n_c > all[0], set probability to 1
-  if (p_c > 1.0)
-    p_c = 1.0;
+    // calculate s_c from inline equation after Eq (11)
+    double p_c = n_c / all[0];
 
-  boost::math::gamma_distribution<> collectionGamma(k[0], theta[0]);
-  double s_c = boost::math::quantile(complement(collectionGamma, p_c));
+    // if n_c > all[0], set probability to 1
+    if (p_c > 1.0)
+      p_c = 1.0;
 
-  // calculate n_i for all shards and store it in ranking vector so we can sort (unnormalized)
-  for (int i = 1; i < _numShards + 1; i++) {
-    // if there are no query terms in shard, skip
-    if (!hasATerm[i]) {
-      ranking->push_back(make_pair(_shardIds[i], 0));
+    double s_c;
+    if (_fastError > 0 && !_boostMode && k[0] > 0 && theta[0] > 0) {
+      s_c = upperGammaQuantile(k[0], theta[0], p_c, _fastError);
+    } else {
+      boost::math::gamma_distribution<> collectionGamma(k[0], theta[0]);
+      s_c = boost::math::quantile(complement(collectionGamma, p_c));
+    }
+
+    if (selection) {
+      _selectShards(shards, hasATerm, queryMean, queryVar, k, theta, all, s_c, n_c, *selection, ranking, scratch);
       continue;
     }
 
-    // if var is ~= 0, then don't build a distribution.
-    // based on the mean of the shard (which is the score of the single doc), n_i is either 0 or 1
-    if (queryVar[i] < 1e-10 && hasATerm[i]) {
-      if (queryMean[i] >= s_c) {
-    	// actually use mean of the shard as score
-        ranking->push_back(make_pair(_shardIds[i], queryMean[i]));
+    // p_i of Eq (12) for all shards with a distribution, computed in one batch
+    _getProbabilities(gammaShard, numGamma, k, theta, s_c, p, work);
+
+    // calculate n_i for all shards and store it in ranking vector so we can sort (unnormalized)
+    for (uint i = 1; i < numActive; i++) {
+      // if there are no query terms in shard, skip
+      if (!hasATerm[i]) {
+        ranking->push_back(ShardScore(shards[i], 0));
+        continue;
+      }
+
+      // if var is ~= 0, then don't build a distribution.
+      // based on the mean of the shard (which is the score of the single doc), n_i is either 0 or 1
+      if (queryVar[i] < 1e-10 && hasATerm[i]) {
+        if (queryMean[i] >= s_c) {
+      	// actually use mean of the shard as score
+          ranking->push_back(ShardScore(shards[i], queryMean[i]));
+        }
+      } else {
+        // do normal Taily stuff pre-normalized Eq (12)
+        ranking->push_back(ShardScore(shards[i], all[i] * p[i]));
       }
+    }
+    if (includeZeroScores) {
+      _addZeroScores(shards, ranking);
+    }
+
+    // sort shards by n
+    sort(ranking->begin(), ranking->end(), shardScoreSort);
+
+    // get normalization factor (top 5 shards sufficient)
+    double sum = 0.0;
+    for (uint i = 0; i < min(5, (int) ranking->size()); i++) {
+      sum += (*ranking)[i].score;
+    }
+    double norm = n_c / sum;
+
+    // normalize shard scores Eq (12)
+    vector<ShardScore>::iterator nit;
+    for (nit = ranking->begin(); nit != ranking->end(); ++nit) {
+      (*nit).score = (*nit).score * norm;
+    }
+  }
+}
+
+void ShardRanker::_getProbabilities(const uint* idx, uint n, double* k, double* theta, double s_c, double* p,
+    double* work) {
+  double* gammaK = work;
+  double* gammaTheta = work + n;
+  double* gammaP = work + 2 * n;
+  double* kernelWork = work + 3 * n;
+
+  uint numGamma = 0;
+  for (uint g = 0; g < n; g++) {
+    uint i = idx[g];
+    if (k[i] > 0 && theta[i] > 0 && !_boostMode) {
+      gammaK[numGamma] = k[i];
+      gammaTheta[numGamma] = theta[i];
+      numGamma++;
     } else {
-      // do normal Taily stuff pre-normalized Eq (12)
+      // outside of the kernel's domain, and left to boost to report, or the reference mode
       boost::math::gamma_distribution<> shardGamma(k[i], theta[i]);
-      double p_i = boost::math::cdf(complement(shardGamma, s_c));
-      ranking->push_back(make_pair(_shardIds[i], all[i] * p_i));
+      p[i] = boost::math::cdf(complement(shardGamma, s_c));
+    }
+  }
+
+  upperGammaQ(gammaK, gammaTheta, s_c, gammaP, numGamma, (_fastError > 0) ? _fastError : GAMMA_EXACT_EPS,
+      kernelWork);
+
+  // same order as above
+  uint next = 0;
+  for (uint g = 0; g < n; g++) {
+    uint i = idx[g];
+    if (k[i] > 0 && theta[i] > 0 && !_boostMode) {
+      p[i] = gammaP[next++];
     }
   }
+}
+
+// (score, local index) pairs, best first
+static bool scoreGreater(const pair<double, uint>& i, const pair<double, uint>& j) {
+  return i.first > j.first;
+}
+
+// true once the best n of scored[0..numScored) can't be beaten by anything left in heap[0..heapSize);
+// scored[0..n) then holds them, best first
+static bool bestKnown(pair<double, uint>* scored, size_t numScored, size_t n, pair<double, uint>* heap,
+    size_t heapSize) {
+  size_t top = min(n, numScored);
+  partial_sort(scored, scored + top, scored + numScored, scoreGreater);
+  return heapSize == 0 || (numScored >= n && scored[n - 1].first >= heap[0].first);
+}
+
+void ShardRanker::_selectShards(vector<uint>& shards, bool* hasATerm, double* queryMean, double* queryVar,
+    double* k, double* theta, double* all, double s_c, uint n_c, const Selection& selection,
+    vector<ShardScore>* ranking, ScratchArena& scratch) {
+  // shards are scored this many at a time, so the gamma kernel still gets whole SIMD blocks
+  static const uint SCORE_BATCH = 16;
+
+  uint numActive = shards.size();
+
+  // max-heap of (upper bound of the unnormalized score, local index) for the shards that can score > 0;
+  // shards with var ~= 0 already know their score. A NaN bound never compares above the cutoff and
+  // would stall the loop below, so shards with a non-finite bound are left out.
+  pair<double, uint>* heap = scratch.alloc<pair<double, uint> >(numActive);
+  size_t heapSize = 0;
+  for (uint i = 1; i < numActive; i++) {
+    if (!hasATerm[i]) {
+      continue;
+    }
+    if (queryVar[i] >= 1e-10) {
+      if (boost::math::isfinite(all[i])) {
+        heap[heapSize++] = make_pair(all[i], i);
+      }
+    } else if (queryMean[i] >= s_c && boost::math::isfinite(queryMean[i])) {
+      heap[heapSize++] = make_pair(queryMean[i], i);
+    }
+  }
+  make_heap(heap, heap + heapSize);
+
+  // unnormalized scores of the shards taken off the heap
+  pair<double, uint>* scored = scratch.alloc<pair<double, uint> >(numActive);
+  size_t numScored = 0;
+  double* p = scratch.alloc<double>(numActive);
+  uint batch[SCORE_BATCH];
+  double* work = scratch.alloc<double>(PROBABILITY_WORK_SIZE * SCORE_BATCH);
+
+  // scores shards until the 5 best are known (they give the normalization factor), and then while
+  // the bound of the next one is still above the cutoff; phase 1 has no cutoff yet
+  double cutoff = -DBL_MAX;
+  size_t need = 5;
+  bool normalized = false;
+  double norm = 0.0;
+
+  while (true) {
+    if (!normalized && bestKnown(scored, numScored, need, heap, heapSize)) {
+      double sum = 0.0;
+      for (size_t i = 0; i < min(need, numScored); i++) {
+        sum += scored[i].first;
+      }
+      if (sum <= 0.0) {
+        // nothing scores above 0
+        return;
+      }
+      norm = n_c / sum;
+      cutoff = selection.v / norm;
+      normalized = true;
+      need = selection.maxK;
+    }
+
+    if (normalized) {
+      // the rest is bounded below the cutoff, or the maxK best are already known
+      if (heapSize == 0 || heap[0].first <= cutoff
+          || (need > 0 && bestKnown(scored, numScored, need, heap, heapSize))) {
+        break;
+      }
+    }
 
-  // sort shards by n
-  sort(ranking->begin(), ranking->end(), shardPairSort);
+    // take the next batch of candidates off the heap and score them
+    uint numBatch = 0;
+    size_t numPopped = 0;
+    while (numBatch < SCORE_BATCH && heapSize > 0 && heap[0].first > cutoff) {
+      uint i = heap[0].second;
+      pop_heap(heap, heap + heapSize);
+      heapSize--;
+      numPopped++;
+
+      if (queryVar[i] < 1e-10) {
+        scored[numScored++] = make_pair(queryMean[i], i);
+      } else {
+        batch[numBatch++] = i;
+      }
+    }
+    if (numPopped == 0) {
+      // nothing left above the cutoff
+      break;
+    }
+    _getProbabilities(batch, numBatch, k, theta, s_c, p, work);
+    for (uint b = 0; b < numBatch; b++) {
+      scored[numScored++] = make_pair(all[batch[b]] * p[batch[b]], batch[b]);
+    }
+  }
 
-  // get normalization factor (top 5 shards sufficient)
-  double sum = 0.0;
-  for (uint i = 0; i < min(5, (int) ranking->size()); i++) {
-    sum += (*ranking)[i].second;
+  // the selected shards, best first and normalized as in Eq (12)
+  size_t numAbove = 0;
+  for (size_t i = 0; i < numScored; i++) {
+    if (scored[i].first > cutoff) {
+      scored[numAbove++] = scored[i];
+    }
   }
-  double norm = _n_c / sum;
 
-  // normalize shard scores Eq (12)
-  vector<pair<string, double> >::iterator nit;
-  for (nit = ranking->begin(); nit != ranking->end(); ++nit) {
-    (*nit).second = (*nit).second * norm;
+  size_t numSelected = (selection.maxK > 0) ? min((size_t) selection.maxK, numAbove) : numAbove;
+  partial_sort(scored, scored + numSelected, scored + numAbove, scoreGreater);
+  for (size_t i = 0; i < numSelected; i++) {
+    ranking->push_back(ShardScore(shards[scored[i].second], scored[i].first * norm));
   }
 }
 
+void ShardRanker::_applySelection(const Selection& selection, vector<ShardScore>* ranking) {
+  vector<ShardScore>::iterator end = ranking->begin();
+  for (vector<ShardScore>::iterator it = ranking->begin(); it != ranking->end(); ++it) {
+    if (it->score > selection.v) {
+      *end++ = *it;
+    }
+  }
+  ranking->erase(end, ranking->end());
+
+  size_t numSelected = ranking->size();
+  if (selection.maxK > 0 && selection.maxK < numSelected) {
+    numSelected = selection.maxK;
+  }
+  partial_sort(ranking->begin(), ranking->begin() + numSelected, ranking->end(), shardScoreSort);
+  ranking->resize(numSelected);
+}
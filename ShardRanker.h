@@ -9,19 +9,69 @@
 #define SHARDRANKER_H_
 
 #include "FeatureStore.h"
+#include "InvertedStore.h"
+#include "RankingCache.h"
+#include "ScratchArena.h"
+#include "ShardScore.h"
+#include "StemCache.h"
 #include "indri/Repository.hpp"
+#include "indri/Mutex.hpp"
+#include <boost/unordered_map.hpp>
 
 using namespace std;
 
+// Once constructed (and init() has returned, if it is used), a ShardRanker may be shared by
+// several threads calling rank() at the same time: stores are only read, through handles opened
+// with DB_THREAD, and all per-query state lives in the call.
 class ShardRanker {
 private:
   // array of FeatureStore pointers
   // stores[0] is the whole collection store; stores[1] onwards is each shard; length is numShards+1
+  // shard stores are left NULL when the term-major inverted store is used instead
   vector<FeatureStore*> _stores;
 
+  // term-major copy of the shard stats, if one was built for these shards; otherwise NULL
+  InvertedStore* _inverted;
+
+  // Berkeley DB environment whose cache is shared by all of the stores above
+  DbEnv* _env;
+
+  // shard sizes from the inverted store; sizes[0] is the corpus size
+  vector<double> _shardSizes;
+
+  // corpus-wide stats of a stem and where its shard list is in _preloadedStats; filled in by init()
+  struct PreloadedTerm {
+    double corpusMin;
+    bool hasCorpusMin;
+    double corpusDf;
+    size_t begin; // shard list is _preloadedStats[begin, end)
+    size_t end;
+
+    PreloadedTerm(): corpusMin(DBL_MAX), hasCorpusMin(false), corpusDf(0.0), begin(0), end(0) {};
+  };
+
+  // what ranking needs to know about one stem
+  struct StemStats {
+    double corpusMin; // DBL_MAX if the corpus has no min feature for the stem
+    bool hasCorpusMin;
+    double corpusDf;
+    vector<ShardTermStats> shards; // shards containing the stem, sorted by shard id
+  };
+
+  // all term stats, if init() loaded them; queries are then answered without touching the dbs
+  boost::unordered_map<string, PreloadedTerm> _preloadedTerms;
+  vector<ShardTermStats> _preloadedStats;
+  bool _preloaded;
+
   // a single indri index built the same way; just for stemming term
   indri::collection::Repository* _repo;
 
+  // stems terms from the config buildcorpus exported to the corpus db when there is no repo
+  TermNormalizer* _normalizer;
+
+  // stems of recently seen query terms; also serializes the stemming, which isn't thread safe
+  StemCache _stemCache;
+
   vector<std::string> _shardIds;
 
   // number of shards
@@ -30,22 +80,166 @@ private:
   // Taily parameter used in Eq (11)
   uint _n_c;
 
-  // retrieves the mean/variance for query terms and fills in the given queryMean/queryVar arrays
-  // and marks shards that have at least one doc for one query term in given bool array
-  void _getQueryFeats(vector<string>& stems, double* queryMean, double* queryVar, bool* hasATerm, double* dfTerm);
+  // working memory of ranking; a call takes an arena from the pool and puts it back when done, so
+  // there is one arena per thread that ranks at the same time
+  vector<ScratchArena*> _scratchPool;
+  indri::thread::Mutex _scratchLock;
+
+  // relative error allowed in s_c and the p_i of Eq (12); 0 computes them exactly
+  double _fastError;
+
+  // if true, s_c and every p_i are computed by boost, as the reference for the other modes
+  bool _boostMode;
+
+  // recent rankings by query stems; off unless setRankingCache() is called
+  RankingCache _rankingCache;
+
+  // key of a query's ranking in _rankingCache; also covers the options that change the ranking
+  string _rankingKey(const vector<string>& stems, bool includeZeroScores);
+
+  // retrieves the mean/variance for query terms from their shard lists and fills in the given
+  // queryMean/queryVar arrays and marks shards that have at least one doc for one query term in given
+  // bool array; arrays are indexed by position in shards (see _getActiveShards);
+  // the df of each stem in each shard is kept in shardDfs[i*stems.size()+j] for _getAll (i = 0 is the corpus)
+  void _getQueryFeats(vector<string>& stems, vector<const StemStats*>& stemStats, vector<uint>& shards,
+      double* queryMean, double* queryVar, bool* hasATerm, double* dfTerm, double* shardDfs);
+
+  // collects the ids of shards that contain at least one query term, sorted; shards[0] is 0 for the corpus
+  void _getActiveShards(vector<const StemStats*>& stemStats, vector<uint>* shards);
+
+  // fetches the corpus and shard stats of each stem; output[j] belongs to stems[j]
+  void _getStemStats(const vector<string>& stems, vector<StemStats>* output);
+
+  // which shards rankTop() returns: those scoring more than v, at most maxK of them (0 for no limit)
+  struct Selection {
+    double v;
+    uint maxK;
+  };
+
+  // ranks shards for a stemmed query whose stats were already fetched; stemStats[j] belongs to stems[j]
+  // if selection is given, only the selected shards are scored in full and returned
+  // all working arrays come from scratch, which is reset first
+  void _rankStems(vector<string>& stems, vector<const StemStats*>& stemStats,
+      vector<ShardScore>* ranking, bool includeZeroScores, ScratchArena& scratch,
+      const Selection* selection = NULL);
+
+  // same, for several values of n_c at once: rankings[c] gets the ranking for n_cs[c]; everything
+  // up to the gamma parameters of the shards is only computed once
+  void _rankStemsSweep(vector<string>& stems, vector<const StemStats*>& stemStats,
+      const uint* n_cs, vector<ShardScore>** rankings, uint numSettings, bool includeZeroScores,
+      ScratchArena& scratch, const Selection* selection = NULL);
+
+  // p_i of Eq (12) for the shards at local indices idx[0..n); results go to p[idx[g]]
+  // work is scratch space for PROBABILITY_WORK_SIZE*n doubles
+  void _getProbabilities(const uint* idx, uint n, double* k, double* theta, double s_c, double* p,
+      double* work);
+
+  // the final, selective part of _rankStems: scores shards in decreasing order of their upper bound
+  // (all[i], as p_i <= 1) and stops once the rest can't be selected
+  void _selectShards(vector<uint>& shards, bool* hasATerm, double* queryMean, double* queryVar,
+      double* k, double* theta, double* all, double s_c, uint n_c, const Selection& selection,
+      vector<ShardScore>* ranking, ScratchArena& scratch);
+
+  // an arena for one ranking call, and its return to the pool
+  ScratchArena* _takeScratch();
+  void _returnScratch(ScratchArena* scratch);
+
+  // keeps only the selected entries of an unnormalized ranking, best first
+  void _applySelection(const Selection& selection, vector<ShardScore>* ranking);
+
+  // adds a zero score for every shard that isn't in shards; ranking must hold scores of shards
+  // from shards in shard id order, and is left with all of them in shard id order
+  void _addZeroScores(vector<uint>& shards, vector<ShardScore>* ranking);
+
+  // fetches the stats of each stem for every shard that contains it; output[j] holds the
+  // shards of stems[j] sorted by shard id
+  void _getShardStats(const vector<string>& stems, vector<vector<ShardTermStats> >* output);
+
+  // fetches the corpus-wide minimum feature (DBL_MAX and hasMin false if there is none) and df of each stem
+  void _getCorpusStats(const vector<string>& stems, vector<double>* mins, vector<bool>* hasMin,
+      vector<double>* dfs);
+
+  // reads every shard list into the preload table; returns false if it would exceed budget bytes
+  bool _preloadShardStats(size_t budget, size_t used);
+
+  // returns the # of docs in shard i; 0 is the whole collection
+  double _getShardSize(uint i);
 
   // tokenizes, stems and stops query term into output vector
   void _getStems(string query, vector<string>* output);
 
-  // calculates All from Eq (10)
-  void _getAll(vector<string>& stems, double* all);
+  // calculates All from Eq (10) for the shards in shards using the shard dfs fetched by _getQueryFeats
+  void _getAll(vector<string>& stems, vector<uint>& shards, double* shardDfs, double* all,
+      ScratchArena& scratch);
 
 public:
-  ShardRanker(vector<string> dbPaths, indri::collection::Repository* repo, uint n_c);
+  // default size of the db cache shared by all stores, in megabytes
+  static const int DEFAULT_CACHE = 512;
+
+  // cache is the total Berkeley DB cache for all dbs in megabytes; busy shards get more of it than idle ones
+  // if repo is NULL, terms are stemmed with the normalizer config in the corpus db (dbPaths[0]),
+  // so no index has to be opened
+  ShardRanker(vector<string> dbPaths, indri::collection::Repository* repo, uint n_c, int cache = DEFAULT_CACHE);
   virtual ~ShardRanker();
 
-  void init();
-  void rank(string query, vector<pair<string, double> >* ranking);
+  // optional preload: reads the shard sizes and, if they fit in budget megabytes, the stats of
+  // every term in the corpus db into memory, so that rank() doesn't read the dbs any more;
+  // stems that aren't in the corpus db are then treated as absent
+  // returns true if the term stats were loaded
+  bool init(int budget = 0);
+
+  // trades exactness for speed: s_c and the shard probabilities are computed to within
+  // relError relative error instead of to full precision; 0 goes back to the exact path
+  // must not be called while other threads are ranking
+  void setFastMode(double relError);
+
+  // reference mode: s_c and every shard probability are computed by boost's gamma distribution
+  // instead of the batched kernel, which is much slower; overrides setFastMode while on
+  // must not be called while other threads are ranking
+  void setBoostMode(bool boost);
+
+  // keeps the rankings of up to capacity distinct queries (by their stems, in any order), so
+  // repeated queries are answered without touching the stats; 0 turns it off (the default)
+  // the cache is cleared whenever init() reloads the stats
+  // must not be called while other threads are ranking
+  void setRankingCache(size_t capacity);
+
+  // the ranking cache, for its counters, or to clear it after the dbs were changed
+  RankingCache& rankingCache();
+
+  // # of shards, not counting the corpus
+  uint numShards() const;
+
+  // name of shard index shard (the last component of its db path)
+  const string& shardName(uint shard) const;
+
+  // the query term stemming cache, for its counters
+  StemCache& stemCache();
+
+  // ranks shards for query; shards that contain none of the query terms are only listed (with a
+  // score of 0) if includeZeroScores is true, which makes the ranking cost grow with the # of shards
+  // ranking is cleared first, so the same buffer can be passed in for every query
+  void rank(string query, vector<ShardScore>* ranking, bool includeZeroScores = false);
+
+  // as above, but appends (shard name, score) pairs to ranking
+  void rank(string query, vector<pair<string, double> >* ranking, bool includeZeroScores = false);
+
+  // ranks shards for query but only returns the ones that would be selected: shards scoring more
+  // than v, best first, and at most maxK of them (0 for no limit); scores are the same as rank()'s,
+  // but shards whose score can't make the cut aren't scored in full
+  // with the ranking cache on, the full ranking is computed (and cached) and then cut instead
+  void rankTop(string query, vector<ShardScore>* ranking, double v, uint maxK = 0);
+
+  // ranks shards for query once per value of n_c, as rank() would with a ranker built with that n_c;
+  // rankings[c] is the ranking for n_cs[c]. Stems, stats and the shards' gamma parameters are
+  // shared by all values, so this costs little more than a single rank()
+  void rankSweep(string query, const vector<uint>& n_cs, vector<vector<ShardScore> >* rankings,
+      bool includeZeroScores = false);
+
+  // ranks shards for every query; rankings[q] is the ranking of queries[q], as rank() would return it
+  // the stats of a stem are fetched once however many queries use it
+  void rankBatch(const vector<string>& queries, vector<vector<ShardScore> >* rankings,
+      bool includeZeroScores = false);
 };
 
 #endif /* SHARDRANKER_H_ */
@@ -0,0 +1,28 @@
+/*
+ * ShardScore.h
+ *
+ *  Created on: Mar 25, 2014
+ *      Author: yubink
+ */
+
+#ifndef SHARDSCORE_H_
+#define SHARDSCORE_H_
+
+#include <sys/types.h>
+
+// one entry of a ranking: shard is the shard's index in the db list the ranker was built with
+// (1 onwards); ShardRanker::shardName() gives its name
+struct ShardScore {
+  uint shard;
+  double score;
+
+  ShardScore(): shard(0), score(0.0) {};
+  ShardScore(uint shard, double score): shard(shard), score(score) {};
+};
+
+// orders rankings best first
+inline bool shardScoreSort(const ShardScore& i, const ShardScore& j) {
+  return (i.score > j.score);
+}
+
+#endif /* SHARDSCORE_H_ */
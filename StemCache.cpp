@@ -0,0 +1,108 @@
+/*
+ * StemCache.cpp
+ *
+ *  Created on: Mar 21, 2014
+ *      Author: yubink
+ */
+
+#include "StemCache.h"
+#include "indri/ScopedLock.hpp"
+#include <boost/functional/hash.hpp>
+
+StemCache::StemCache(indri::collection::Repository* repo, size_t capacity) :
+    _repo(repo), _normalizer(NULL) {
+  _setCapacity(capacity);
+}
+
+StemCache::StemCache(indri::collection::Repository* repo, TermNormalizer* normalizer, size_t capacity) :
+    _repo(repo), _normalizer(normalizer) {
+  _setCapacity(capacity);
+}
+
+void StemCache::_setCapacity(size_t capacity) {
+  _segmentCapacity = capacity / NUM_SEGMENTS;
+  if (_segmentCapacity == 0) {
+    _segmentCapacity = 1;
+  }
+}
+
+string StemCache::stem(const string& term) {
+  Segment& segment = _segment(term);
+  {
+    indri::thread::ScopedLock lock(segment.lock);
+    boost::unordered_map<string, LruList::iterator>::iterator it = segment.index.find(term);
+    if (it != segment.index.end()) {
+      // move to the front of the LRU list
+      segment.lru.splice(segment.lru.begin(), segment.lru, it->second);
+      segment.hits++;
+      if (it->second->second.empty()) {
+        segment.stopwordHits++;
+      }
+      return it->second->second;
+    }
+    segment.misses++;
+  }
+
+  // the segment isn't held while stemming, so other terms of the segment can still be looked up
+  string stem;
+  {
+    indri::thread::ScopedLock lock(_repoLock);
+    if (_normalizer != NULL) {
+      stem = _normalizer->process(term);
+    } else {
+      stem = _repo->processTerm(term);
+    }
+  }
+
+  indri::thread::ScopedLock lock(segment.lock);
+  if (segment.index.find(term) == segment.index.end()) {
+    segment.lru.push_front(make_pair(term, stem));
+    segment.index[term] = segment.lru.begin();
+
+    if (segment.lru.size() > _segmentCapacity) {
+      segment.index.erase(segment.lru.back().first);
+      segment.lru.pop_back();
+    }
+  }
+  return stem;
+}
+
+uint64_t StemCache::hits() {
+  uint64_t total = 0;
+  for (size_t s = 0; s < NUM_SEGMENTS; s++) {
+    indri::thread::ScopedLock lock(_segments[s].lock);
+    total += _segments[s].hits;
+  }
+  return total;
+}
+
+uint64_t StemCache::stopwordHits() {
+  uint64_t total = 0;
+  for (size_t s = 0; s < NUM_SEGMENTS; s++) {
+    indri::thread::ScopedLock lock(_segments[s].lock);
+    total += _segments[s].stopwordHits;
+  }
+  return total;
+}
+
+uint64_t StemCache::misses() {
+  uint64_t total = 0;
+  for (size_t s = 0; s < NUM_SEGMENTS; s++) {
+    indri::thread::ScopedLock lock(_segments[s].lock);
+    total += _segments[s].misses;
+  }
+  return total;
+}
+
+size_t StemCache::size() {
+  size_t total = 0;
+  for (size_t s = 0; s < NUM_SEGMENTS; s++) {
+    indri::thread::ScopedLock lock(_segments[s].lock);
+    total += _segments[s].index.size();
+  }
+  return total;
+}
+
+StemCache::Segment& StemCache::_segment(const string& term) {
+  return _segments[boost::hash<string>()(term) % NUM_SEGMENTS];
+}
@@ -0,0 +1,83 @@
+/*
+ * StemCache.h
+ *
+ * Bounded term -> stem cache in front of Repository::processTerm (or a
+ * TermNormalizer exported from the same index). Stopwords are
+ * remembered too, as an empty stem. Entries are spread over segments by hash;
+ * each segment is an LRU list with its own lock, so threads stemming different
+ * terms rarely wait on each other.
+ *
+ *  Created on: Mar 21, 2014
+ *      Author: yubink
+ */
+
+#ifndef STEMCACHE_H_
+#define STEMCACHE_H_
+
+#include "TermNormalizer.h"
+#include "indri/Repository.hpp"
+#include "indri/Mutex.hpp"
+#include <stdint.h>
+#include <string>
+#include <list>
+#include <utility>
+#include <boost/unordered_map.hpp>
+
+using namespace std;
+
+class StemCache {
+public:
+  static const size_t DEFAULT_CAPACITY = 100000;
+  static const size_t NUM_SEGMENTS = 16;
+
+private:
+  typedef list<pair<string, string> > LruList;
+
+  struct Segment {
+    indri::thread::Mutex lock;
+    LruList lru; // most recently used first
+    boost::unordered_map<string, LruList::iterator> index;
+    uint64_t hits;
+    uint64_t stopwordHits;
+    uint64_t misses;
+
+    Segment(): hits(0), stopwordHits(0), misses(0) {};
+  };
+
+  indri::collection::Repository* _repo;
+  TermNormalizer* _normalizer;
+
+  // neither Repository::processTerm nor TermNormalizer::process is thread safe
+  indri::thread::Mutex _repoLock;
+
+  Segment _segments[NUM_SEGMENTS];
+
+  // max # of entries in one segment
+  size_t _segmentCapacity;
+
+public:
+  // repo does the actual stemming and stopping; capacity is the max # of terms kept
+  StemCache(indri::collection::Repository* repo, size_t capacity = DEFAULT_CAPACITY);
+
+  // same, but if normalizer isn't NULL, it does the stemming and stopping instead of repo, so
+  // repo may be NULL and no index needs to be open
+  StemCache(indri::collection::Repository* repo, TermNormalizer* normalizer, size_t capacity = DEFAULT_CAPACITY);
+
+  // stem of term, as Repository::processTerm returns it; empty if term is a stopword
+  string stem(const string& term);
+
+  // lookups answered from the cache (stopwordHits of them were stopwords) and lookups that
+  // went to the repository or normalizer
+  uint64_t hits();
+  uint64_t stopwordHits();
+  uint64_t misses();
+
+  // # of terms cached
+  size_t size();
+
+private:
+  void _setCapacity(size_t capacity);
+  Segment& _segment(const string& term);
+};
+
+#endif /* STEMCACHE_H_ */
@@ -523,9 +523,6 @@ int main(int argc, char * argv[]) {
       LEMUR_THROW( LEMUR_BAD_PARAMETER_ERROR,
           "Smoothing rules may not be specified when running a baseline.");
 
-    if (!param.exists("sampleIndex"))
-      LEMUR_THROW( LEMUR_MISSING_PARAMETER_ERROR, "Must specify a indri index for term processing.");
-
     // trec output
     if (!param.exists("trecOutput"))
       LEMUR_THROW( LEMUR_MISSING_PARAMETER_ERROR,
@@ -558,10 +555,16 @@ int main(int argc, char * argv[]) {
     // load some parameters for Taily
     int n_c = param.get("n_c");
     int v = param.get("v");
+    int maxShards = param.get("tailyMaxShards", 0);
 
-    // sample index used by Taily to do term tokenization/stem/stopping
+    // sample index used by Taily to do term tokenization/stem/stopping; without one, the
+    // normalizer config that buildcorpus exported to the corpus db is used
     indri::collection::Repository sampleRepo;
-    sampleRepo.open(param.get("sampleIndex"));
+    indri::collection::Repository* sampleRepoPtr = NULL;
+    if (param.exists("sampleIndex")) {
+      sampleRepo.open(param.get("sampleIndex"));
+      sampleRepoPtr = &sampleRepo;
+    }
 
     // load taily statistics dbs; dbs[0] is corpus wide and the rest are shards
     std::string corpusDb = param.get("corpusDb");
@@ -581,31 +584,38 @@ int main(int argc, char * argv[]) {
     std::cout << start << std::endl;
 
     // initialize shard ranker
-    ShardRanker ranker(dbs, &sampleRepo, n_c);
+    ShardRanker ranker(dbs, sampleRepoPtr, n_c, param.get("tailyRam", ShardRanker::DEFAULT_CACHE));
+    ranker.init(param.get("tailyPreload", 0));
+    ranker.setFastMode(param.get("tailyFastError", 0.0));
+    ranker.setRankingCache(param.get("tailyRankCache", 0));
+
+    // daemon of each shard by shard index; a type of -1 means no daemon was given for it
+    std::vector<std::pair<std::string, int> > shardDaemons(ranker.numShards() + 1,
+        std::make_pair(std::string(), -1));
+    for (uint i = 1; i <= ranker.numShards(); i++) {
+      std::map<string, std::pair<std::string, int> >::iterator dit = daemons.find(ranker.shardName(i));
+      if (dit != daemons.end()) {
+        shardDaemons[i] = dit->second;
+      }
+    }
 
     std::cout << getTime() - start << std::endl;
 
+    // reused by every query
+    std::vector<ShardScore> ranking;
+
     while (!queries.empty()) {
       double start = getTime();
 
       query_t* query = queries.front();
 
-      std::vector<std::pair<string, double> > ranking;
-      ranker.rank(query->text, &ranking);
+      // only the shards scoring above v come back, best first
+      ranker.rankTop(query->text, &ranking, v, maxShards);
 
       std::cout << "Taily Ranking done : " << getTime() - start << std::endl; // csi-retr
 
       double shardRankStart = getTime();
 
-      std::vector<string> shards;
-      for(size_t i = 0; i < ranking.size(); i++) {
-        if (ranking[i].second > v) {
-          shards.push_back(ranking[i].first);
-        } else {
-          break;
-        }
-      }
-
       std::cout << "Ranking done : " << getTime() - start << std::endl; // shard-ranking
       std::cout << "Time taken to rank shards " << getTime() - shardRankStart
           << std::endl; // shard-ranking
@@ -614,23 +624,23 @@ int main(int argc, char * argv[]) {
       QueryClient* client = new QueryClient(param);
       client->initialize();
 
-      if (shards.size() == 0) {
+      if (ranking.size() == 0) {
         std::cout << "No shards selected!" << std::endl;
         return 0;
       }
 
       double shardRetrievalStart = getTime();
       int cnt = 0;
-      for (int i = 0; i < shards.size(); i++) {
-        string shardId = shards[i];
-        if (daemons.count(shardId) == 0)
+      for (int i = 0; i < ranking.size(); i++) {
+        std::pair<std::string, int>& daemon = shardDaemons[ranking[i].shard];
+        if (daemon.second == -1)
           continue;
 
         // server-value is 0
-        std::cout << shardId << " " << daemons[shardId].first << std::endl;
-        daemons[shardId].second == 0 ?
-            client->addServer(daemons[shardId].first) :
-            client->addIndex(daemons[shardId].first);
+        std::cout << ranker.shardName(ranking[i].shard) << " " << daemon.first << std::endl;
+        daemon.second == 0 ?
+            client->addServer(daemon.first) :
+            client->addIndex(daemon.first);
         cnt++;
       }
 
@@ -649,6 +659,10 @@ int main(int argc, char * argv[]) {
       queries.pop();
     }
     std::cout << getTime() << std::endl;
+    std::cout << "Stem cache hits " << ranker.stemCache().hits() << " misses "
+        << ranker.stemCache().misses() << std::endl;
+    std::cout << "Ranking cache hits " << ranker.rankingCache().hits() << " misses "
+        << ranker.rankingCache().misses() << std::endl;
 
   } catch (lemur::api::Exception& e) {
     LEMUR_ABORT(e);
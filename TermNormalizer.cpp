@@ -0,0 +1,124 @@
+/*
+ * TermNormalizer.cpp
+ *
+ *  Created on: Mar 24, 2014
+ *      Author: yubink
+ */
+
+#include "TermNormalizer.h"
+#include "indri/NormalizationTransformation.hpp"
+#include "indri/UTF8CaseNormalizationTransformation.hpp"
+#include "indri/StopperTransformation.hpp"
+#include "indri/StemmerFactory.hpp"
+#include <stdlib.h>
+#include <string.h>
+#include <fstream>
+#include <iostream>
+
+const char* TermNormalizer::FILE_NAME = "normalizer.txt";
+
+TermNormalizer::TermNormalizer(string dir) {
+  string path = dir + "/" + FILE_NAME;
+  ifstream file(path.c_str());
+  if (!file.is_open()) {
+    cerr << "Couldn't open term normalizer config " << path << ". Exiting." << endl;
+    exit(EXIT_FAILURE);
+  }
+
+  bool normalize = true;
+  string stemmer;
+  vector<string> stopwords;
+
+  string line;
+  while (getline(file, line)) {
+    size_t eq = line.find('=');
+    if (eq == string::npos) {
+      continue;
+    }
+    string key = line.substr(0, eq);
+    string value = line.substr(eq + 1);
+
+    if (key == "normalize") {
+      normalize = (value == "true");
+    } else if (key == "stemmer") {
+      stemmer = value;
+    } else if (key == "stopword") {
+      stopwords.push_back(value);
+    }
+  }
+  file.close();
+
+  // same order as the chain Repository builds: normalization, stopping, stemming
+  if (normalize) {
+    _transformations.push_back(new indri::parse::NormalizationTransformation());
+    _transformations.push_back(new indri::parse::UTF8CaseNormalizationTransformation());
+  }
+  if (!stopwords.empty()) {
+    _transformations.push_back(new indri::parse::StopperTransformation(stopwords));
+  }
+  if (!stemmer.empty()) {
+    indri::api::Parameters stemmerParams;
+    indri::parse::Transformation* transformation = indri::parse::StemmerFactory::get(stemmer, stemmerParams);
+    if (transformation == NULL) {
+      cerr << "Unknown stemmer " << stemmer << " in " << path << ". Exiting." << endl;
+      exit(EXIT_FAILURE);
+    }
+    _transformations.push_back(transformation);
+  }
+}
+
+TermNormalizer::~TermNormalizer() {
+  vector<indri::parse::Transformation*>::iterator it;
+  for (it = _transformations.begin(); it != _transformations.end(); ++it) {
+    delete (*it);
+  }
+}
+
+string TermNormalizer::process(const string& term) {
+  // a one-term document through the chain, as Repository::processTerm does
+  _buffer.assign(term.c_str(), term.c_str() + term.size() + 1);
+  char* termCopy = &_buffer[0];
+
+  indri::api::ParsedDocument original;
+  original.text = termCopy;
+  original.textLength = term.size() + 1;
+  original.terms.push_back(termCopy);
+
+  indri::api::ParsedDocument* document = &original;
+  vector<indri::parse::Transformation*>::iterator it;
+  for (it = _transformations.begin(); it != _transformations.end(); ++it) {
+    document = (*it)->transform(document);
+  }
+
+  string result;
+  if (document->terms.size() > 0 && document->terms[0] != NULL) {
+    result = document->terms[0];
+  }
+  return result;
+}
+
+void TermNormalizer::exportConfig(indri::collection::Repository* repo, string dir) {
+  indri::api::Parameters& params = repo->parameters();
+
+  string path = dir + "/" + FILE_NAME;
+  ofstream file(path.c_str());
+  if (!file.is_open()) {
+    cerr << "Couldn't write term normalizer config " << path << ". Exiting." << endl;
+    exit(EXIT_FAILURE);
+  }
+
+  bool normalize = !(params.exists("normalize") && !((bool) params["normalize"]));
+  file << "normalize=" << (normalize ? "true" : "false") << endl;
+
+  if (params.exists("stemmer.name")) {
+    file << "stemmer=" << (string) params["stemmer.name"] << endl;
+  }
+
+  if (params.exists("stopper.word")) {
+    indri::api::Parameters words = params["stopper.word"];
+    for (size_t i = 0; i < words.size(); i++) {
+      file << "stopword=" << (string) words[i] << endl;
+    }
+  }
+  file.close();
+}
@@ -0,0 +1,47 @@
+/*
+ * TermNormalizer.h
+ *
+ * Does what Repository::processTerm does for an index (case normalization,
+ * stopping and stemming) without opening the index. buildcorpus exports the
+ * index's stemmer and stopword list next to the corpus db; rankers load that.
+ *
+ *  Created on: Mar 24, 2014
+ *      Author: yubink
+ */
+
+#ifndef TERMNORMALIZER_H_
+#define TERMNORMALIZER_H_
+
+#include "indri/Repository.hpp"
+#include "indri/Transformation.hpp"
+#include <string>
+#include <vector>
+
+using namespace std;
+
+class TermNormalizer {
+public:
+  // key=value lines: normalize=true|false, stemmer=<name> and one stopword=<word> per stopword
+  static const char* FILE_NAME;
+
+private:
+  // applied in order, as in the index's own chain
+  vector<indri::parse::Transformation*> _transformations;
+
+  // copy of the term being processed; the transformations work on it in place
+  vector<char> _buffer;
+
+public:
+  // loads the config exported to dir; exits if there is none
+  TermNormalizer(string dir);
+  virtual ~TermNormalizer();
+
+  // stem of term; empty if it is a stopword
+  // not thread safe (neither are Indri's stemmers)
+  string process(const string& term);
+
+  // writes the config of repo's term processing into dir; exits if it can't be written
+  static void exportConfig(indri::collection::Repository* repo, string dir);
+};
+
+#endif /* TERMNORMALIZER_H_ */